@@ -0,0 +1,427 @@
+/*
+** Benchmarks for lispy. Each suite generates inputs
+** of growing size, runs the built interpreter on them
+** as scripts, or mpc in this process, and prints the
+** wall clock time of the best of a few runs, or of one
+** run taking over a second. Build and run with
+**
+**   cc -I. bench.c mpc.c -lm -o bench
+**   ./bench ./lispy [suite...]
+**
+** Suites are picked by name, and all run if none are
+** given. Timing a whole run includes starting lispy,
+** so that is timed first, on an empty script, and
+** taken off where a suite gives a time per item.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "mpc.h"
+#include <time.h>
+#include <unistd.h>
+
+enum { BENCH_RUNS = 3 };
+
+static const char *lispy;
+static char input[] = "/tmp/lispy-bench-XXXXXX";
+static double startup;
+
+static double bench_now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (double)t.tv_sec + (double)t.tv_nsec / 1e9;
+}
+
+/* Write the input for size n with gen, replacing the last one */
+static void bench_input(void (*gen)(FILE*, long), long n) {
+  FILE *f = fopen(input, "w");
+  if (f == NULL) { perror(input); exit(1); }
+  gen(f, n);
+  fclose(f);
+}
+
+/* Run lispy with flags on the input, giving the best time, or -1 if it failed */
+static double bench_run(const char *flags) {
+
+  char cmd[1024];
+  double best = -1, t;
+  int k;
+
+  snprintf(cmd, sizeof(cmd), "%s %s %s >/dev/null 2>&1", lispy, flags, input);
+  for (k = 0; k < BENCH_RUNS; k++) {
+    t = bench_now();
+    if (system(cmd) != 0) { return -1; }
+    t = bench_now() - t;
+    if (best < 0 || t < best) { best = t; }
+    if (t > 1) { break; }
+  }
+
+  return best;
+}
+
+static void bench_print(double t) {
+  if (t < 0) { printf(" %9s", "failed"); } else { printf(" %9.3f", t); }
+}
+
+/* Print the time per item of n taking t, if it is longer than starting up */
+static void bench_print_each(double t, long n) {
+  if (t <= startup) { printf(" %9s", "-"); } else { printf(" %9.1f", (t - startup) * 1e9 / (double)n); }
+}
+
+/*
+** Args
+**
+** One call to + with n arguments, for n from ten to a
+** million, to show the cost per argument stays flat.
+*/
+
+static void gen_args(FILE *f, long n) {
+  long j;
+  fputs("(+", f);
+  for (j = 1; j <= n; j++) { fprintf(f, " %ld", j); }
+  fputs(")\n", f);
+}
+
+static void bench_args(void) {
+
+  long n;
+  double t;
+
+  printf("args: (+ 1 2 ... n)\n");
+  printf("%9s %9s %9s\n", "n", "s", "ns/arg");
+  for (n = 10; n <= 1000000; n *= 10) {
+    bench_input(gen_args, n);
+    t = bench_run("");
+    printf("%9ld", n);
+    bench_print(t);
+    bench_print_each(t, n);
+    printf("\n");
+  }
+  printf("\n");
+}
+
+/*
+** VM
+**
+** The bytecode VM against the tree walker, on the same
+** arithmetic nested n deep, and spread n wide as one
+** call over n small ones.
+*/
+
+static void gen_deep(FILE *f, long n) {
+  long j;
+  for (j = 0; j < n; j++) { fputs("(+ 1 ", f); }
+  fputs("1", f);
+  for (j = 0; j < n; j++) { fputc(')', f); }
+  fputc('\n', f);
+}
+
+static void gen_wide(FILE *f, long n) {
+  long j;
+  fputs("(+", f);
+  for (j = 0; j < n; j++) { fprintf(f, " (* %ld (- %ld 1))", j % 7, j % 5); }
+  fputs(")\n", f);
+}
+
+static void bench_vm_table(const char *title, void (*gen)(FILE*, long)) {
+
+  long n;
+  double tree, vm;
+
+  printf("%s\n", title);
+  printf("%9s %9s %9s %9s\n", "n", "tree s", "vm s", "vm/tree");
+  for (n = 10; n <= 1000000; n *= 10) {
+    bench_input(gen, n);
+    tree = bench_run("--max-depth 10000000");
+    vm = bench_run("--vm --max-depth 10000000");
+    printf("%9ld", n);
+    bench_print(tree);
+    bench_print(vm);
+    if (tree > 0 && vm > 0) { printf(" %9.2f", vm / tree); }
+    printf("\n");
+  }
+  printf("\n");
+}
+
+static void bench_vm(void) {
+  bench_vm_table("vm deep: (+ 1 (+ 1 ... 1))", gen_deep);
+  bench_vm_table("vm wide: (+ (* a (- b 1)) ...)", gen_wide);
+}
+
+/*
+** Jobs
+**
+** The same input run with --jobs 1, 2, 4 and so on to
+** twice the processors online, or at least to 4, as
+** read by lispy and as parsed by mpc, which also
+** splits up the parse. The input is a few forms, each
+** summing calls big enough to be evaluated apart.
+*/
+
+static void gen_jobs(FILE *f, long n) {
+  long j, k, m;
+  for (j = 0; j < n; j++) {
+    fputs("(+", f);
+    for (k = 0; k < 16; k++) {
+      fputs(" (+", f);
+      for (m = 0; m < 8192; m++) { fprintf(f, " %ld", (j + k + m) % 10); }
+      fputc(')', f);
+    }
+    fputs(")\n", f);
+  }
+}
+
+static void bench_jobs(void) {
+
+  char flags[64];
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN), jobs;
+  double read, mpc, read1 = 0, mpc1 = 0;
+
+  if (cpus < 2) { cpus = 2; }
+
+  bench_input(gen_jobs, 8);
+  printf("jobs: 8 forms of 16 calls of 8192 arguments\n");
+  printf("%9s %9s %9s %9s %9s\n", "jobs", "read s", "speedup", "mpc s", "speedup");
+  for (jobs = 1; jobs <= cpus * 2; jobs *= 2) {
+    snprintf(flags, sizeof(flags), "--jobs %ld", jobs);
+    read = bench_run(flags);
+    snprintf(flags, sizeof(flags), "--mpc --jobs %ld", jobs);
+    mpc = bench_run(flags);
+    if (jobs == 1) { read1 = read; mpc1 = mpc; }
+    printf("%9ld", jobs);
+    bench_print(read);
+    if (read > 0) { printf(" %9.2f", read1 / read); } else { printf(" %9s", "-"); }
+    bench_print(mpc);
+    if (mpc > 0) { printf(" %9.2f", mpc1 / mpc); } else { printf(" %9s", "-"); }
+    printf("\n");
+  }
+  printf("(%ld processors online)\n\n", sysconf(_SC_NPROCESSORS_ONLN));
+}
+
+/*
+** Arena
+**
+** Evaluating in an arena against --no-arena, which
+** mallocs and frees every value, on n small forms.
+*/
+
+static void gen_forms(FILE *f, long n) {
+  long j;
+  for (j = 0; j < n; j++) {
+    fprintf(f, "(+ (* %ld 2) (- %ld (max 1 2 3)) (/ 8 2))\n", j % 100, j % 10);
+  }
+}
+
+static void bench_arena(void) {
+
+  long n;
+  double arena, heap;
+
+  printf("arena: n forms of (+ (* a 2) (- b (max 1 2 3)) (/ 8 2))\n");
+  printf("%9s %9s %9s %9s\n", "n", "arena s", "malloc s", "ratio");
+  for (n = 10; n <= 1000000; n *= 10) {
+    bench_input(gen_forms, n);
+    arena = bench_run("");
+    heap = bench_run("--no-arena");
+    printf("%9ld", n);
+    bench_print(arena);
+    bench_print(heap);
+    if (arena > 0 && heap > 0) { printf(" %9.2f", heap / arena); }
+    printf("\n");
+  }
+  printf("\n");
+}
+
+/*
+** Parse
+**
+** mpc_parse on its own, with a grammar for lispy that
+** keeps no output, over inputs from 1KB to 100MB. The
+** rate should hold steady as the input grows.
+*/
+
+static mpc_parser_t *bench_grammar(mpc_parser_t *Expr) {
+
+  mpc_parser_t *Number = mpc_apply(mpc_stripl(mpc_re("-?[0-9]+")), mpcf_free);
+  mpc_parser_t *Symbol = mpc_apply(mpc_stripl(mpc_oneof("+-*/")), mpcf_free);
+  mpc_parser_t *Sexpr = mpc_and(3, mpcf_null,
+    mpc_apply(mpc_stripl(mpc_char('(')), mpcf_free),
+    mpc_many(mpcf_null, Expr),
+    mpc_apply(mpc_stripl(mpc_char(')')), mpcf_free),
+    mpcf_dtor_null, mpcf_dtor_null);
+
+  mpc_define(Expr, mpc_or(3, Number, Symbol, Sexpr));
+  return mpc_whole(mpc_stripr(mpc_many(mpcf_null, Expr)), mpcf_dtor_null);
+}
+
+/* Repeat a form for a string of about n bytes, stopping at a form's end */
+static char *bench_string(size_t n) {
+  static const char form[] = "(+ 1 (* 23 -4) (- 5)) ";
+  char *s = malloc(n + 1);
+  size_t j;
+  n -= n % (sizeof(form) - 1);
+  for (j = 0; j < n; j++) { s[j] = form[j % (sizeof(form) - 1)]; }
+  s[n] = '\0';
+  return s;
+}
+
+static void bench_parse(void) {
+
+  mpc_parser_t *Expr = mpc_new("expr");
+  mpc_parser_t *Lispy = bench_grammar(Expr);
+  mpc_result_t r;
+  size_t n;
+  double best, t;
+  char *s;
+  int k, ok;
+
+  printf("parse: mpc_parse of (+ 1 (* 23 -4) (- 5)) repeated\n");
+  printf("%9s %9s %9s\n", "bytes", "s", "MB/s");
+  for (n = 1000; n <= 100000000; n *= 10) {
+    s = bench_string(n);
+    best = -1;
+    for (k = 0; k < BENCH_RUNS; k++) {
+      t = bench_now();
+      ok = mpc_parse("<bench>", s, Lispy, &r);
+      t = bench_now() - t;
+      if (!ok) { mpc_err_print(r.error); mpc_err_delete(r.error); best = -1; break; }
+      if (best < 0 || t < best) { best = t; }
+      if (t > 1) { break; }
+    }
+    printf("%9lu", (unsigned long)strlen(s));
+    bench_print(best);
+    if (best > 0) { printf(" %9.2f", (double)strlen(s) / best / 1e6); }
+    printf("\n");
+    free(s);
+  }
+  printf("\n");
+
+  mpc_delete(Lispy);
+  mpc_cleanup(1, Expr);
+}
+
+/*
+** Stack
+**
+** The same grammar parsed by mpc_parse, which recurses
+** in C, and by the program compiled from it, which
+** keeps its own stack, on about 1MB of forms nested
+** as deep as scripts usually are. lispy only turns to
+** the program past LISPVAL_MPC_RECURSE levels, so its
+** cost here is what such input pays, not every script.
+*/
+
+/* Repeat a form nested depth deep for a string of about n bytes */
+static char *bench_nested(size_t n, int depth) {
+  char *s = malloc(n + 8 * depth + 8), *p = s;
+  int k;
+  while ((size_t)(p - s) < n) {
+    for (k = 0; k < depth; k++) { p += sprintf(p, "(+ %d ", k); }
+    *p++ = '1';
+    for (k = 0; k < depth; k++) { *p++ = ')'; }
+    *p++ = ' ';
+  }
+  *p = '\0';
+  return s;
+}
+
+/* Time the best of a few parses of s, by prog if given, else by p */
+static double bench_parse_one(const char *s, mpc_parser_t *p, mpc_program_t *prog) {
+
+  mpc_result_t r;
+  double best = -1, t;
+  int k, ok;
+
+  for (k = 0; k < BENCH_RUNS; k++) {
+    t = bench_now();
+    ok = prog ? mpc_parse_program("<bench>", s, strlen(s), prog, &r) : mpc_parse("<bench>", s, p, &r);
+    t = bench_now() - t;
+    if (!ok) { mpc_err_print(r.error); mpc_err_delete(r.error); return -1; }
+    if (best < 0 || t < best) { best = t; }
+    if (t > 1) { break; }
+  }
+
+  return best;
+}
+
+static void bench_stack(void) {
+
+  mpc_parser_t *Expr = mpc_new("expr");
+  mpc_parser_t *Lispy = bench_grammar(Expr);
+  mpc_program_t *prog = mpc_compile(Lispy);
+  double rec, stack;
+  char *s;
+  int depth;
+
+  printf("stack: mpc_parse against mpc_parse_program, 1MB nested depth deep\n");
+  printf("%9s %9s %9s %9s\n", "depth", "C stack s", "program s", "ratio");
+  for (depth = 1; depth <= 64; depth *= 2) {
+    s = bench_nested(1000000, depth);
+    rec = bench_parse_one(s, Lispy, NULL);
+    stack = bench_parse_one(s, Lispy, prog);
+    printf("%9d", depth);
+    bench_print(rec);
+    bench_print(stack);
+    if (rec > 0 && stack > 0) { printf(" %9.2f", stack / rec); }
+    printf("\n");
+    free(s);
+  }
+  printf("\n");
+
+  mpc_program_delete(prog);
+  mpc_delete(Lispy);
+  mpc_cleanup(1, Expr);
+}
+
+static struct {
+  const char *name;
+  void (*run)(void);
+} suites[] = {
+  { "args", bench_args },
+  { "vm", bench_vm },
+  { "jobs", bench_jobs },
+  { "arena", bench_arena },
+  { "parse", bench_parse },
+  { "stack", bench_stack }
+};
+
+int main(int argc, char **argv) {
+
+  int fd, i, j, n = (int)(sizeof(suites) / sizeof(suites[0]));
+
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s lispy [suite...]\n", argv[0]);
+    return 1;
+  }
+  lispy = argv[1];
+  setvbuf(stdout, NULL, _IOLBF, 0);
+
+  for (i = 2; i < argc; i++) {
+    for (j = 0; j < n; j++) {
+      if (strcmp(argv[i], suites[j].name) == 0) { break; }
+    }
+    if (j == n) { fprintf(stderr, "%s: no suite %s\n", argv[0], argv[i]); return 1; }
+  }
+
+  fd = mkstemp(input);
+  if (fd < 0) { perror(input); return 1; }
+  close(fd);
+
+  startup = bench_run("");
+  if (startup < 0) {
+    fprintf(stderr, "%s: could not run %s\n", argv[0], lispy);
+    remove(input);
+    return 1;
+  }
+  printf("startup: %.3f s\n\n", startup);
+
+  for (j = 0; j < n; j++) {
+    for (i = 2; i < argc; i++) {
+      if (strcmp(argv[i], suites[j].name) == 0) { break; }
+    }
+    if (argc == 2 || i < argc) { suites[j].run(); }
+  }
+
+  remove(input);
+  return 0;
+}
@@ -1,5 +1,17 @@
 #include "mpc.h"
 
+#if defined(__unix__) || defined(__APPLE__)
+#define MPC_USE_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 /*
 ** State Type
 */
@@ -62,7 +74,8 @@ enum {
 };
 
 enum {
-  MPC_INPUT_MARKS_MIN = 32
+  MPC_INPUT_MARKS_MIN = 32,
+  MPC_INPUT_BUFFER_MIN = 1024
 };
 
 enum {
@@ -73,52 +86,94 @@ typedef struct {
   char mem[64];
 } mpc_mem_t;
 
+struct mpc_memo_t;
+
 typedef struct {
 
   int type;
   char *filename;  
-  mpc_state_t state;
+  long pos;
+  mpc_state_t origin;
   
   char *string;
+  char *end;
+  size_t length;
+  int borrowed;
   char *buffer;
+  size_t buffer_len;
+  size_t buffer_slots;
+  long buffer_pos;
   FILE *file;
   
   int suppress;
   int backtrack;
+  int touched;
   int marks_slots;
   int marks_num;
-  mpc_state_t *marks;
+  long *marks;
+  
+  long *lines;
+  long lines_num;
+  long lines_slots;
+  long lines_end;
+  long lines_hint;
   
   char *lasts;
   char last;
   
+  struct mpc_memo_t *memo;
+  size_t memo_slots;
+  size_t memo_bytes;
+  size_t memo_hand;
+  
   size_t mem_index;
   char mem_full[MPC_INPUT_MEM_NUM];
   mpc_mem_t mem[MPC_INPUT_MEM_NUM];
   
 } mpc_input_t;
 
-static mpc_input_t *mpc_input_new_string(const char *filename, const char *string) {
+/*
+** Every kind of input starts out the same, apart
+** from where its characters come from, which the
+** constructors below fill in afterwards.
+*/
+static mpc_input_t *mpc_input_new(const char *filename, int type) {
 
   mpc_input_t *i = malloc(sizeof(mpc_input_t));
   
   i->filename = malloc(strlen(filename) + 1);
   strcpy(i->filename, filename);
-  i->type = MPC_INPUT_STRING;
+  i->type = type;
   
-  i->state = mpc_state_new();
+  i->pos = 0;
+  i->origin = mpc_state_new();
   
-  i->string = malloc(strlen(string) + 1);
-  strcpy(i->string, string);
+  i->string = NULL;
+  i->end = NULL;
+  i->length = 0;
+  i->borrowed = 0;
   i->buffer = NULL;
+  i->buffer_len = 0;
+  i->buffer_slots = 0;
+  i->buffer_pos = 0;
   i->file = NULL;
   
   i->suppress = 0;
   i->backtrack = 1;
+  i->touched = 0;
+  i->memo = NULL;
+  i->memo_slots = 0;
+  i->memo_bytes = 0;
+  i->memo_hand = 0;
   i->marks_num = 0;
   i->marks_slots = MPC_INPUT_MARKS_MIN;
-  i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
+  i->marks = malloc(sizeof(long) * i->marks_slots);
   i->lasts = malloc(sizeof(char) * i->marks_slots);
+  i->lines = NULL;
+  i->lines_num = 0;
+  i->lines_slots = 0;
+  i->lines_end = 0;
+  i->lines_hint = 0;
   i->last = '\0';
   
   i->mem_index = 0;
@@ -127,32 +182,46 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
   return i;
 }
 
-static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *string, size_t length) {
+static mpc_input_t *mpc_input_new_string(const char *filename, const char *string) {
 
-  mpc_input_t *i = malloc(sizeof(mpc_input_t));
+  mpc_input_t *i = mpc_input_new(filename, MPC_INPUT_STRING);
   
-  i->filename = malloc(strlen(filename) + 1);
-  strcpy(i->filename, filename);
-  i->type = MPC_INPUT_STRING;
+  i->length = strlen(string);
+  i->string = malloc(i->length + 1);
+  memcpy(i->string, string, i->length + 1);
+  i->end = i->string + i->length;
   
-  i->state = mpc_state_new();
+  return i;
+}
+
+static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *string, size_t length) {
+
+  mpc_input_t *i = mpc_input_new(filename, MPC_INPUT_STRING);
   
   i->string = malloc(length + 1);
-  strncpy(i->string, string, length);
+  memcpy(i->string, string, length);
   i->string[length] = '\0';
-  i->buffer = NULL;
-  i->file = NULL;
+  i->length = length;
+  i->end = i->string + i->length;
   
-  i->suppress = 0;
-  i->backtrack = 1;
-  i->marks_num = 0;
-  i->marks_slots = MPC_INPUT_MARKS_MIN;
-  i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
-  i->lasts = malloc(sizeof(char) * i->marks_slots);
-  i->last = '\0';
+  return i;
+
+}
+
+/*
+** A view parses the caller's buffer in place. The
+** buffer must outlive the input and need not be
+** terminated, since only the first length bytes are
+** ever read.
+*/
+static mpc_input_t *mpc_input_new_view(const char *filename, const char *string, size_t length) {
+
+  mpc_input_t *i = mpc_input_new(filename, MPC_INPUT_STRING);
   
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  i->string = (char*)string;
+  i->length = length;
+  i->end = i->string + i->length;
+  i->borrowed = 1;
   
   return i;
 
@@ -160,57 +229,16 @@ static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *stri
 
 static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
 
-  mpc_input_t *i = malloc(sizeof(mpc_input_t));
-  
-  i->filename = malloc(strlen(filename) + 1);
-  strcpy(i->filename, filename);
-  
-  i->type = MPC_INPUT_PIPE;
-  i->state = mpc_state_new();
-  
-  i->string = NULL;
-  i->buffer = NULL;
+  mpc_input_t *i = mpc_input_new(filename, MPC_INPUT_PIPE);
   i->file = pipe;
-  
-  i->suppress = 0;
-  i->backtrack = 1;
-  i->marks_num = 0;
-  i->marks_slots = MPC_INPUT_MARKS_MIN;
-  i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
-  i->lasts = malloc(sizeof(char) * i->marks_slots);
-  i->last = '\0';
-  
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
-  
   return i;
   
 }
 
 static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   
-  mpc_input_t *i = malloc(sizeof(mpc_input_t));
-  
-  i->filename = malloc(strlen(filename) + 1);
-  strcpy(i->filename, filename);
-  i->type = MPC_INPUT_FILE;
-  i->state = mpc_state_new();
-  
-  i->string = NULL;
-  i->buffer = NULL;
+  mpc_input_t *i = mpc_input_new(filename, MPC_INPUT_FILE);
   i->file = file;
-  
-  i->suppress = 0;
-  i->backtrack = 1;
-  i->marks_num = 0;
-  i->marks_slots = MPC_INPUT_MARKS_MIN;
-  i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
-  i->lasts = malloc(sizeof(char) * i->marks_slots);
-  i->last = '\0';
-  
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
-  
   return i;
 }
 
@@ -218,18 +246,27 @@ static void mpc_input_delete(mpc_input_t *i) {
   
   free(i->filename);
   
-  if (i->type == MPC_INPUT_STRING) { free(i->string); }
+  if (i->type == MPC_INPUT_STRING && !i->borrowed) { free(i->string); }
   if (i->type == MPC_INPUT_PIPE) { free(i->buffer); }
   
   free(i->marks);
+  free(i->lines);
   free(i->lasts);
   free(i);
 }
 
+/*
+** Pool blocks are only ever handed out whole, so
+** anything not on a block boundary is some other
+** value - such as a tagged integer - that merely
+** happens to fall within the pool's address range.
+*/
+
 static int mpc_mem_ptr(mpc_input_t *i, void *p) {
   return
     (char*)p >= (char*)(i->mem) &&
-    (char*)p <  (char*)(i->mem) + (MPC_INPUT_MEM_NUM * sizeof(mpc_mem_t));
+    (char*)p <  (char*)(i->mem) + (MPC_INPUT_MEM_NUM * sizeof(mpc_mem_t)) &&
+    ((size_t)((char*)p - (char*)(i->mem))) % sizeof(mpc_mem_t) == 0;
 }
 
 static void *mpc_malloc(mpc_input_t *i, size_t n) {
@@ -304,17 +341,13 @@ static void mpc_input_mark(mpc_input_t *i) {
   
   if (i->marks_num > i->marks_slots) {
     i->marks_slots = i->marks_num + i->marks_num / 2;
-    i->marks = realloc(i->marks, sizeof(mpc_state_t) * i->marks_slots);
+    i->marks = realloc(i->marks, sizeof(long) * i->marks_slots);
     i->lasts = realloc(i->lasts, sizeof(char) * i->marks_slots);
   }
 
-  i->marks[i->marks_num-1] = i->state;
+  i->marks[i->marks_num-1] = i->pos;
   i->lasts[i->marks_num-1] = i->last;
   
-  if (i->type == MPC_INPUT_PIPE && i->marks_num == 1) {
-    i->buffer = calloc(1, 1);
-  }
-  
 }
 
 static void mpc_input_unmark(mpc_input_t *i) {
@@ -328,13 +361,15 @@ static void mpc_input_unmark(mpc_input_t *i) {
     i->marks_slots = 
       i->marks_num > MPC_INPUT_MARKS_MIN ?
       i->marks_num : MPC_INPUT_MARKS_MIN;
-    i->marks = realloc(i->marks, sizeof(mpc_state_t) * i->marks_slots);
+    i->marks = realloc(i->marks, sizeof(long) * i->marks_slots);
     i->lasts = realloc(i->lasts, sizeof(char) * i->marks_slots);      
   }
   
-  if (i->type == MPC_INPUT_PIPE && i->marks_num == 0) {
-    free(i->buffer);
-    i->buffer = NULL;
+  /* With no marks left, bytes already consumed can never be read again */
+  if (i->type == MPC_INPUT_PIPE && i->marks_num == 0
+  &&  i->pos == i->buffer_pos + (long)i->buffer_len) {
+    i->buffer_pos = i->pos;
+    i->buffer_len = 0;
   }
   
 }
@@ -343,28 +378,117 @@ static void mpc_input_rewind(mpc_input_t *i) {
   
   if (i->backtrack < 1) { return; }
   
-  i->state = i->marks[i->marks_num-1];
+  i->pos  = i->marks[i->marks_num-1];
   i->last  = i->lasts[i->marks_num-1];
   
   if (i->type == MPC_INPUT_FILE) {
-    fseek(i->file, i->state.pos, SEEK_SET);
+    fseek(i->file, i->pos, SEEK_SET);
   }
   
   mpc_input_unmark(i);
 }
 
+/*
+** Pipes cannot seek, so bytes read while a mark is
+** outstanding are kept in a buffer for rewinding.
+** The buffer covers the stream from buffer_pos on.
+** Bytes before the oldest mark are dropped when it
+** fills up, and it only grows, geometrically, when
+** the backtrack window itself needs the room.
+*/
+
 static int mpc_input_buffer_in_range(mpc_input_t *i) {
-  return i->state.pos < (long)(strlen(i->buffer) + i->marks[0].pos);
+  return i->pos < i->buffer_pos + (long)i->buffer_len;
 }
 
 static char mpc_input_buffer_get(mpc_input_t *i) {
-  return i->buffer[i->state.pos - i->marks[0].pos];
+  return i->buffer[i->pos - i->buffer_pos];
+}
+
+static void mpc_input_buffer_push(mpc_input_t *i, char c) {
+  
+  size_t drop;
+  
+  if (i->marks_num == 0) {
+    i->buffer_pos = i->pos + 1;
+    i->buffer_len = 0;
+    return;
+  }
+  
+  if (i->buffer_len == i->buffer_slots) {
+    drop = (size_t)(i->marks[0] - i->buffer_pos);
+    if (drop > 0 && drop >= i->buffer_slots / 2) {
+      memmove(i->buffer, i->buffer + drop, i->buffer_len - drop);
+      i->buffer_len -= drop;
+      i->buffer_pos += (long)drop;
+    } else {
+      i->buffer_slots = i->buffer_slots ? i->buffer_slots * 2 : MPC_INPUT_BUFFER_MIN;
+      i->buffer = realloc(i->buffer, i->buffer_slots);
+    }
+  }
+  
+  i->buffer[i->buffer_len++] = c;
+}
+
+/*
+** Only the position is tracked while parsing. Rows
+** and columns are worked out from an index of where
+** the newlines are, for states in the output and for
+** the one error that is returned. String inputs fill
+** the index in lazily with memchr, streams as each
+** character is first consumed. The origin is the row
+** and column of position zero.
+*/
+
+static void mpc_input_line(mpc_input_t *i, long pos) {
+  if (i->lines_num == i->lines_slots) {
+    i->lines_slots = i->lines_slots ? i->lines_slots * 2 : MPC_INPUT_MARKS_MIN;
+    i->lines = realloc(i->lines, sizeof(long) * i->lines_slots);
+  }
+  i->lines[i->lines_num++] = pos;
+}
+
+static mpc_state_t mpc_input_state_at(mpc_input_t *i, long pos) {
+  
+  mpc_state_t s;
+  const char *c, *nl;
+  long lo, hi, mid;
+  int k;
+  
+  if (i->type == MPC_INPUT_STRING && pos > i->lines_end) {
+    c = i->string + i->lines_end;
+    while ((nl = memchr(c, '\n', (size_t)(i->string + pos - c))) != NULL) {
+      mpc_input_line(i, (long)(nl - i->string));
+      c = nl + 1;
+    }
+    i->lines_end = pos;
+  }
+  
+  /*
+  ** Count the newlines before pos. Lookups mostly move
+  ** forward a little from the one before, so look just
+  ** past that first and only then search the rest.
+  */
+  lo = i->lines_hint;
+  if (lo > 0 && i->lines[lo-1] >= pos) { lo = 0; }
+  hi = i->lines_num;
+  for (k = 0; k < 4 && lo < hi && i->lines[lo] < pos; k++) { lo++; }
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (i->lines[mid] < pos) { lo = mid + 1; } else { hi = mid; }
+  }
+  i->lines_hint = lo;
+  
+  s.pos = pos;
+  s.row = i->origin.row + lo;
+  s.col = lo > 0 ? pos - i->lines[lo-1] - 1 : i->origin.col + pos;
+  return s;
 }
 
 static int mpc_input_terminated(mpc_input_t *i) {
-  if (i->type == MPC_INPUT_STRING && i->state.pos == (long)strlen(i->string)) { return 1; }
+  if (i->type == MPC_INPUT_STRING && i->string + i->pos == i->end) { i->touched = 1; return 1; }
   if (i->type == MPC_INPUT_FILE && feof(i->file)) { return 1; }
-  if (i->type == MPC_INPUT_PIPE && feof(i->file)) { return 1; }
+  if (i->type == MPC_INPUT_PIPE && !mpc_input_buffer_in_range(i) && feof(i->file)) { return 1; }
   return 0;
 }
 
@@ -374,13 +498,11 @@ static char mpc_input_getc(mpc_input_t *i) {
   
   switch (i->type) {
     
-    case MPC_INPUT_STRING: return i->string[i->state.pos];
+    case MPC_INPUT_STRING: return i->string + i->pos < i->end ? i->string[i->pos] : '\0';
     case MPC_INPUT_FILE: c = fgetc(i->file); return c;
     case MPC_INPUT_PIPE:
     
-      if (!i->buffer) { c = getc(i->file); return c; }
-      
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
+      if (mpc_input_buffer_in_range(i)) {
         c = mpc_input_buffer_get(i);
         return c;
       } else {
@@ -397,7 +519,10 @@ static char mpc_input_peekc(mpc_input_t *i) {
   char c = '\0';
   
   switch (i->type) {
-    case MPC_INPUT_STRING: return i->string[i->state.pos];
+    case MPC_INPUT_STRING:
+      if (i->string + i->pos < i->end) { return i->string[i->pos]; }
+      i->touched = 1;
+      return '\0';
     case MPC_INPUT_FILE: 
       
       c = fgetc(i->file);
@@ -408,14 +533,7 @@ static char mpc_input_peekc(mpc_input_t *i) {
     
     case MPC_INPUT_PIPE:
       
-      if (!i->buffer) {
-        c = getc(i->file);
-        if (feof(i->file)) { return '\0'; }
-        ungetc(c, i->file);
-        return c;
-      }
-      
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
+      if (mpc_input_buffer_in_range(i)) {
         return mpc_input_buffer_get(i);
       } else {
         c = getc(i->file);
@@ -436,9 +554,7 @@ static int mpc_input_failure(mpc_input_t *i, char c) {
     case MPC_INPUT_FILE: fseek(i->file, -1, SEEK_CUR); { break; }
     case MPC_INPUT_PIPE: {
       
-      if (!i->buffer) { ungetc(c, i->file); break; }
-      
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
+      if (mpc_input_buffer_in_range(i)) {
         break;
       } else {
         ungetc(c, i->file); 
@@ -451,22 +567,19 @@ static int mpc_input_failure(mpc_input_t *i, char c) {
 
 static int mpc_input_success(mpc_input_t *i, char c, char **o) {
   
-  if (i->type == MPC_INPUT_PIPE
-  &&  i->buffer && !mpc_input_buffer_in_range(i)) {
-    i->buffer = realloc(i->buffer, strlen(i->buffer) + 2);
-    i->buffer[strlen(i->buffer) + 1] = '\0';
-    i->buffer[strlen(i->buffer) + 0] = c;
+  if (i->type == MPC_INPUT_PIPE && !mpc_input_buffer_in_range(i)) {
+    mpc_input_buffer_push(i, c);
   }
   
-  i->last = c;
-  i->state.pos++;
-  i->state.col++;
-  
-  if (c == '\n') {
-    i->state.col = 0;
-    i->state.row++;
+  /* Streams cannot be read back, so their newlines are indexed as first passed */
+  if (i->type != MPC_INPUT_STRING && i->pos == i->lines_end) {
+    if (c == '\n') { mpc_input_line(i, i->pos); }
+    i->lines_end++;
   }
   
+  i->last = c;
+  i->pos++;
+  
   if (o) {
     (*o) = mpc_malloc(i, 2);
     (*o)[0] = c;
@@ -494,16 +607,68 @@ static int mpc_input_range(mpc_input_t *i, char c, char d, char **o) {
   return x >= c && x <= d ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);  
 }
 
-static int mpc_input_oneof(mpc_input_t *i, const char *c, char **o) {
+/*
+** Character sets are 256-bit bitmaps, built once when
+** a oneof or noneof parser is created, so testing a
+** character is a single bit test. NUL is never in a
+** set, as it cannot appear in the string given.
+**
+** A set is also kept as a few spans of consecutive
+** characters (whitespace is two, letters digits and
+** underscore are four) which runs of the set can be
+** scanned against many characters at a time.
+*/
+
+enum { MPC_SET_SPANS = 4 };
+
+typedef struct {
+  int num;
+  int neg;
+  unsigned char lo[MPC_SET_SPANS];
+  unsigned char hi[MPC_SET_SPANS];
+} mpc_spans_t;
+
+typedef struct {
+  unsigned char bits[256 / 8];
+  mpc_spans_t spans;
+} mpc_set_t;
+
+static int mpc_set_has(const mpc_set_t *set, char c) {
+  return set->bits[(unsigned char)c >> 3] & (1 << ((unsigned char)c & 7));
+}
+
+static mpc_set_t *mpc_set_new(const char *s) {
+  
+  int c;
+  mpc_set_t *set = calloc(1, sizeof(mpc_set_t));
+  for (; *s; s++) { set->bits[(unsigned char)*s >> 3] |= 1 << ((unsigned char)*s & 7); }
+  
+  /* A num of -1 marks a set with too many spans to scan */
+  for (c = 1; c < 256; c++) {
+    if (!mpc_set_has(set, (char)c)) { continue; }
+    if (c > 1 && mpc_set_has(set, (char)(c-1))) {
+      set->spans.hi[set->spans.num-1] = (unsigned char)c;
+      continue;
+    }
+    if (set->spans.num == MPC_SET_SPANS) { set->spans.num = -1; break; }
+    set->spans.lo[set->spans.num] = (unsigned char)c;
+    set->spans.hi[set->spans.num] = (unsigned char)c;
+    set->spans.num++;
+  }
+  
+  return set;
+}
+
+static int mpc_input_oneof(mpc_input_t *i, const mpc_set_t *set, char **o) {
   char x = mpc_input_getc(i);
   if (mpc_input_terminated(i)) { return 0; }
-  return strchr(c, x) != 0 ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);  
+  return mpc_set_has(set, x) ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);  
 }
 
-static int mpc_input_noneof(mpc_input_t *i, const char *c, char **o) {
+static int mpc_input_noneof(mpc_input_t *i, const mpc_set_t *set, char **o) {
   char x = mpc_input_getc(i);
   if (mpc_input_terminated(i)) { return 0; }
-  return strchr(c, x) == 0 ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);  
+  return !mpc_set_has(set, x) ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);  
 }
 
 static int mpc_input_satisfy(mpc_input_t *i, int(*cond)(char), char **o) {
@@ -538,7 +703,7 @@ static int mpc_input_anchor(mpc_input_t* i, int(*f)(char,char), char **o) {
 
 static mpc_state_t *mpc_input_state_copy(mpc_input_t *i) {
   mpc_state_t *r = mpc_malloc(i, sizeof(mpc_state_t));
-  memcpy(r, &i->state, sizeof(mpc_state_t));
+  *r = mpc_input_state_at(i, i->pos);
   return r;
 }
 
@@ -575,14 +740,13 @@ static void mpc_err_string_cat(char *buffer, int *pos, int *max, char const *fmt
   va_end(va);
 }
 
-static char char_unescape_buffer[4];
-
-static const char *mpc_err_char_unescape(char c) {
+/* Quoted characters are written to the caller's buffer, so threads never share one */
+static const char *mpc_err_char_unescape(char c, char *buffer) {
   
-  char_unescape_buffer[0] = '\'';
-  char_unescape_buffer[1] = ' ';
-  char_unescape_buffer[2] = '\'';
-  char_unescape_buffer[3] = '\0';
+  buffer[0] = '\'';
+  buffer[1] = ' ';
+  buffer[2] = '\'';
+  buffer[3] = '\0';
   
   switch (c) {
     case '\a': return "bell";
@@ -595,8 +759,8 @@ static const char *mpc_err_char_unescape(char c) {
     case '\t': return "tab";
     case ' ' : return "space";
     default:
-      char_unescape_buffer[1] = c;
-      return char_unescape_buffer;
+      buffer[1] = c;
+      return buffer;
   }
   
 }
@@ -606,6 +770,7 @@ char *mpc_err_string(mpc_err_t *x) {
   int i;  
   int pos = 0; 
   int max = 1023;
+  char quoted[4];
   char *buffer = calloc(1, 1024);
   
   if (x->failure) {
@@ -631,7 +796,7 @@ char *mpc_err_string(mpc_err_t *x) {
   }
   
   mpc_err_string_cat(buffer, &pos, &max, " at ");
-  mpc_err_string_cat(buffer, &pos, &max, mpc_err_char_unescape(x->recieved));
+  mpc_err_string_cat(buffer, &pos, &max, mpc_err_char_unescape(x->recieved, quoted));
   mpc_err_string_cat(buffer, &pos, &max, "\n");
   
   return realloc(buffer, strlen(buffer) + 1);
@@ -643,7 +808,8 @@ static mpc_err_t *mpc_err_new(mpc_input_t *i, const char *expected) {
   x = mpc_malloc(i, sizeof(mpc_err_t));
   x->filename = mpc_malloc(i, strlen(i->filename) + 1);
   strcpy(x->filename, i->filename);
-  x->state = i->state;
+  x->state = mpc_state_new();
+  x->state.pos = i->pos;
   x->expected_num = 1;
   x->expected = mpc_malloc(i, sizeof(char*));
   x->expected[0] = mpc_malloc(i, strlen(expected) + 1);
@@ -659,7 +825,8 @@ static mpc_err_t *mpc_err_fail(mpc_input_t *i, const char *failure) {
   x = mpc_malloc(i, sizeof(mpc_err_t));
   x->filename = mpc_malloc(i, strlen(i->filename) + 1);
   strcpy(x->filename, i->filename);
-  x->state = i->state;
+  x->state = mpc_state_new();
+  x->state.pos = i->pos;
   x->expected_num = 0;
   x->expected = NULL;
   x->failure = mpc_malloc(i, strlen(failure) + 1);
@@ -694,6 +861,8 @@ static void mpc_err_delete_internal(mpc_input_t *i, mpc_err_t *x) {
 
 static mpc_err_t *mpc_err_export(mpc_input_t *i, mpc_err_t *x) {
   int j;
+  /* Errors only carry a position until now, as most are thrown away */
+  if (x->state.pos >= 0) { x->state = mpc_input_state_at(i, x->state.pos); }
   for (j = 0; j < x->expected_num; j++) {
     x->expected[j] = mpc_export(i, x->expected[j]);
   }
@@ -892,7 +1061,7 @@ typedef struct { int(*f)(char,char); } mpc_pdata_anchor_t;
 typedef struct { char x; } mpc_pdata_single_t;
 typedef struct { char x; char y; } mpc_pdata_range_t;
 typedef struct { int(*f)(char); } mpc_pdata_satisfy_t;
-typedef struct { char *x; } mpc_pdata_string_t;
+typedef struct { char *x; mpc_set_t *set; } mpc_pdata_string_t;
 typedef struct { mpc_parser_t *x; mpc_apply_t f; } mpc_pdata_apply_t;
 typedef struct { mpc_parser_t *x; mpc_apply_to_t f; void *d; } mpc_pdata_apply_to_t;
 typedef struct { mpc_parser_t *x; } mpc_pdata_predict_t;
@@ -921,11 +1090,187 @@ typedef union {
 
 struct mpc_parser_t {
   char retained;
+  char packrat;
+  char frozen;
   char *name;
   char type;
   mpc_pdata_t data;
 };
 
+/*
+** Character Runs
+**
+** A many or many1 of a single character class folded
+** with mpcf_strfold, with or without an expect around
+** the class, is matched as one run. The input is
+** scanned directly and the whole run is copied out
+** into a single allocation, rather than allocating a
+** string per character and joining them afterwards.
+*/
+
+static int mpc_class_parser(char type) {
+  return type == MPC_TYPE_ANY   || type == MPC_TYPE_SINGLE
+      || type == MPC_TYPE_RANGE || type == MPC_TYPE_ONEOF
+      || type == MPC_TYPE_NONEOF || type == MPC_TYPE_SATISFY;
+}
+
+static int mpc_class_test(char type, mpc_pdata_t *d, char x) {
+  switch (type) {
+    case MPC_TYPE_ANY:     return 1;
+    case MPC_TYPE_SINGLE:  return x == d->single.x;
+    case MPC_TYPE_RANGE:   return x >= d->range.x && x <= d->range.y;
+    case MPC_TYPE_ONEOF:   return mpc_set_has(d->string.set, x);
+    case MPC_TYPE_NONEOF:  return !mpc_set_has(d->string.set, x);
+    case MPC_TYPE_SATISFY: return d->satisfy.f(x);
+    default: return 0;
+  }
+}
+
+/*
+** The class repeated by x. Builtins such as mpc_digit
+** put an expect around mpc_oneof, which has its own,
+** so any number of expects are looked through. Only
+** the outermost can report, so its message sets *m.
+*/
+static mpc_parser_t *mpc_run_class(mpc_parser_t *x, char **m) {
+  *m = x->type == MPC_TYPE_EXPECT ? x->data.expect.m : NULL;
+  while (x->type == MPC_TYPE_EXPECT) { x = x->data.expect.x; }
+  return mpc_class_parser(x->type) ? x : NULL;
+}
+
+#if defined(__SSE2__)
+
+/* The class type as spans, or 0 if it cannot be put that way */
+static int mpc_class_spans(char type, mpc_pdata_t *d, mpc_spans_t *sp) {
+  switch (type) {
+    case MPC_TYPE_ANY:
+      sp->num = 0; sp->neg = 1;
+      return 1;
+    case MPC_TYPE_SINGLE:
+      sp->num = 1; sp->neg = 0;
+      sp->lo[0] = sp->hi[0] = (unsigned char)d->single.x;
+      return 1;
+    case MPC_TYPE_RANGE:
+      /* Ranges compare as char, which only agrees with bytes for ASCII */
+      if (d->range.x < 0 || d->range.y < 0) { return 0; }
+      sp->num = d->range.x <= d->range.y ? 1 : 0; sp->neg = 0;
+      sp->lo[0] = (unsigned char)d->range.x;
+      sp->hi[0] = (unsigned char)d->range.y;
+      return 1;
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+      if (d->string.set->spans.num < 0) { return 0; }
+      *sp = d->string.set->spans;
+      sp->neg = type == MPC_TYPE_NONEOF;
+      return 1;
+    default: return 0;
+  }
+}
+
+/*
+** Count how many of the n characters at s are in the
+** spans, sixteen at a time. Bytes are flipped by 0x80
+** so the signed compares SSE2 has order them as
+** unsigned. Whatever is left over is for the caller.
+*/
+static size_t mpc_spans_scan(const char *s, size_t n, const mpc_spans_t *sp) {
+  
+  __m128i lo[MPC_SET_SPANS], hi[MPC_SET_SPANS];
+  __m128i flip = _mm_set1_epi8((char)0x80);
+  __m128i x, out;
+  size_t k = 0;
+  int j, stop;
+  
+  for (j = 0; j < sp->num; j++) {
+    lo[j] = _mm_set1_epi8((char)(sp->lo[j] ^ 0x80));
+    hi[j] = _mm_set1_epi8((char)(sp->hi[j] ^ 0x80));
+  }
+  
+  while (k + 16 <= n) {
+    x = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(s + k)), flip);
+    out = _mm_set1_epi8((char)0xFF);
+    for (j = 0; j < sp->num; j++) {
+      out = _mm_and_si128(out, _mm_or_si128(
+        _mm_cmpgt_epi8(lo[j], x), _mm_cmpgt_epi8(x, hi[j])));
+    }
+    stop = _mm_movemask_epi8(out);
+    if (sp->neg) { stop = ~stop & 0xFFFF; }
+    if (stop) {
+      while (!(stop & 1)) { stop >>= 1; k++; }
+      return k;
+    }
+    k += 16;
+  }
+  
+  return k;
+}
+
+#endif
+
+/* Match the longest run of class type, returning its length */
+static long mpc_input_run(mpc_input_t *i, char type, mpc_pdata_t *d, char **o) {
+  
+  const char *s, *start;
+  char x;
+  long n = 0;
+  size_t slots;
+#if defined(__SSE2__)
+  mpc_spans_t sp;
+#endif
+  
+  if (i->type == MPC_INPUT_STRING) {
+    
+    start = s = i->string + i->pos;
+#if defined(__SSE2__)
+    if (mpc_class_spans(type, d, &sp)) { s += mpc_spans_scan(s, (size_t)(i->end - s), &sp); }
+#endif
+    while (s < i->end && mpc_class_test(type, d, *s)) { s++; }
+    if (s == i->end) { i->touched = 1; }
+    
+    n = (long)(s - start);
+    if (n > 0) { i->last = s[-1]; }
+    i->pos += n;
+    
+    *o = mpc_malloc(i, (size_t)n + 1);
+    memcpy(*o, start, (size_t)n);
+    (*o)[n] = '\0';
+    return n;
+  }
+  
+  /* Streams are read a character at a time into a growing buffer */
+  slots = sizeof(mpc_mem_t);
+  *o = mpc_malloc(i, slots);
+  while (1) {
+    x = mpc_input_getc(i);
+    if (mpc_input_terminated(i)) { break; }
+    if (!mpc_class_test(type, d, x)) { mpc_input_failure(i, x); break; }
+    mpc_input_success(i, x, NULL);
+    if ((size_t)n + 1 == slots) {
+      slots *= 2;
+      *o = mpc_realloc(i, *o, slots);
+    }
+    (*o)[n++] = x;
+  }
+  (*o)[n] = '\0';
+  return n;
+}
+
+/* Run a many (or many1) of class type, as mpc_parse_run would */
+static int mpc_parse_class(mpc_input_t *i, int many1, char type, mpc_pdata_t *d, const char *m, mpc_result_t *r, mpc_err_t **e) {
+  
+  long n = mpc_input_run(i, type, d, (char**)&r->output);
+  mpc_err_t *x = m ? mpc_err_new(i, m) : NULL;
+  
+  if (many1 && n == 0) {
+    mpc_free(i, r->output);
+    r->error = mpc_err_many1(i, x);
+    return 0;
+  }
+  
+  if (x) { *e = mpc_err_merge(i, *e, x); }
+  return 1;
+}
+
 static mpc_val_t *mpcf_input_nth_free(mpc_input_t *i, int n, mpc_val_t **xs, int x) {
   int j;
   for (j = 0; j < n; j++) { if (j != x) { mpc_free(i, xs[j]); } }
@@ -938,11 +1283,21 @@ static mpc_val_t *mpcf_input_trd_free(mpc_input_t *i, int n, mpc_val_t **xs) { r
 
 static mpc_val_t *mpcf_input_strfold(mpc_input_t *i, int n, mpc_val_t **xs) {
   int j;
-  size_t l = 0;
+  size_t l = 0, k;
+  char *end;
   if (n == 0) { return mpc_calloc(i, 1, 1); }
   for (j = 0; j < n; j++) { l += strlen(xs[j]); }
+  k = strlen(xs[0]);
   xs[0] = mpc_realloc(i, xs[0], l + 1);
-  for (j = 1; j < n; j++) { strcat(xs[0], xs[j]); mpc_free(i, xs[j]); }
+  /* Append at the end rather than strcat, which rescans from the start */
+  end = (char*)xs[0] + k;
+  for (j = 1; j < n; j++) {
+    k = strlen(xs[j]);
+    memcpy(end, xs[j], k);
+    end += k;
+    mpc_free(i, xs[j]);
+  }
+  *end = '\0';
   return xs[0];
 }
 
@@ -1006,12 +1361,22 @@ enum {
   if (x) { MPC_SUCCESS(r->output); } \
   else { MPC_FAILURE(NULL); }
 
+static int mpc_parse_memo(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e);
+static int mpc_parse_step(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e);
+
 static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e) {
+  if (i->memo && p->packrat) { return mpc_parse_memo(i, p, r, e); }
+  return mpc_parse_step(i, p, r, e);
+}
+
+static int mpc_parse_step(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e) {
   
   int j = 0, k = 0;
   mpc_result_t results_stk[MPC_PARSE_STACK_MIN];
   mpc_result_t *results;
   int results_slots = MPC_PARSE_STACK_MIN;
+  mpc_parser_t *x;
+  char *m;
   
   switch (p->type) {
       
@@ -1020,8 +1385,8 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
     case MPC_TYPE_ANY:     MPC_PRIMITIVE(mpc_input_any(i, (char**)&r->output));
     case MPC_TYPE_SINGLE:  MPC_PRIMITIVE(mpc_input_char(i, p->data.single.x, (char**)&r->output));
     case MPC_TYPE_RANGE:   MPC_PRIMITIVE(mpc_input_range(i, p->data.range.x, p->data.range.y, (char**)&r->output));
-    case MPC_TYPE_ONEOF:   MPC_PRIMITIVE(mpc_input_oneof(i, p->data.string.x, (char**)&r->output));
-    case MPC_TYPE_NONEOF:  MPC_PRIMITIVE(mpc_input_noneof(i, p->data.string.x, (char**)&r->output));
+    case MPC_TYPE_ONEOF:   MPC_PRIMITIVE(mpc_input_oneof(i, p->data.string.set, (char**)&r->output));
+    case MPC_TYPE_NONEOF:  MPC_PRIMITIVE(mpc_input_noneof(i, p->data.string.set, (char**)&r->output));
     case MPC_TYPE_SATISFY: MPC_PRIMITIVE(mpc_input_satisfy(i, p->data.satisfy.f, (char**)&r->output));
     case MPC_TYPE_STRING:  MPC_PRIMITIVE(mpc_input_string(i, p->data.string.x, (char**)&r->output));
     case MPC_TYPE_ANCHOR:  MPC_PRIMITIVE(mpc_input_anchor(i, p->data.anchor.f, (char**)&r->output));
@@ -1101,6 +1466,10 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
     
     case MPC_TYPE_MANY:
       
+      if (p->data.repeat.f == mpcf_strfold && (x = mpc_run_class(p->data.repeat.x, &m))) {
+        return mpc_parse_class(i, 0, x->type, &x->data, m, r, e);
+      }
+      
       results = results_stk;
       
       while (mpc_parse_run(i, p->data.repeat.x, &results[j], e)) {
@@ -1122,6 +1491,10 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
     
     case MPC_TYPE_MANY1:
       
+      if (p->data.repeat.f == mpcf_strfold && (x = mpc_run_class(p->data.repeat.x, &m))) {
+        return mpc_parse_class(i, 1, x->type, &x->data, m, r, e);
+      }
+      
       results = results_stk;
       
       while (mpc_parse_run(i, p->data.repeat.x, &results[j], e)) {
@@ -1147,90 +1520,731 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
           if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
       }
     
-    case MPC_TYPE_COUNT:
+    case MPC_TYPE_COUNT:
+      
+      results = p->data.repeat.n > MPC_PARSE_STACK_MIN
+        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.repeat.n)
+        : results_stk;
+      
+      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e)) {
+        j++;
+        if (j == p->data.repeat.n) { break; }
+      }
+      
+      if (j == p->data.repeat.n) {
+        MPC_SUCCESS(
+          mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
+          if (p->data.repeat.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+      } else {
+        for (k = 0; k < j; k++) {
+          mpc_parse_dtor(i, p->data.repeat.dx, results[k].output);
+        }
+        MPC_FAILURE(
+          mpc_err_count(i, results[j].error, p->data.repeat.n);
+          if (p->data.repeat.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });  
+      }
+      
+    /* Combinatory Parsers */
+    
+    case MPC_TYPE_OR:
+      
+      if (p->data.or.n == 0) { MPC_SUCCESS(NULL); }
+      
+      results = p->data.or.n > MPC_PARSE_STACK_MIN
+        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
+        : results_stk;
+      
+      for (j = 0; j < p->data.or.n; j++) {
+        if (mpc_parse_run(i, p->data.or.xs[j], &results[j], e)) {
+          MPC_SUCCESS(results[j].output;
+            if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+        } else {
+          *e = mpc_err_merge(i, *e, results[j].error);
+        } 
+      }
+      
+      MPC_FAILURE(NULL;
+        if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+    
+    case MPC_TYPE_AND:
+      
+      if (p->data.and.n == 0) { MPC_SUCCESS(NULL); }
+      
+      results = p->data.or.n > MPC_PARSE_STACK_MIN
+        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
+        : results_stk;
+      
+      mpc_input_mark(i);
+      for (j = 0; j < p->data.and.n; j++) {
+        if (!mpc_parse_run(i, p->data.and.xs[j], &results[j], e)) {
+          mpc_input_rewind(i);
+          for (k = 0; k < j; k++) {
+            mpc_parse_dtor(i, p->data.and.dxs[k], results[k].output);
+          }
+          MPC_FAILURE(results[j].error;
+            if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+        }
+      }
+      mpc_input_unmark(i); 
+      MPC_SUCCESS(
+        mpc_parse_fold(i, p->data.and.f, j, (mpc_val_t**)results);
+        if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+    
+    /* End */
+    
+    default:
+      
+      MPC_FAILURE(mpc_err_fail(i, "Unknown Parser Type Id!"));
+  }
+  
+  return 0;
+  
+}
+
+#undef MPC_SUCCESS
+#undef MPC_FAILURE
+#undef MPC_PRIMITIVE
+
+/*
+** Packrat
+**
+** Rules marked as packrat have their result at each
+** position remembered, so trying them again at the
+** same place is a lookup. Rule outputs are ASTs and
+** are shared with the table rather than copied: each
+** node is allocated behind a count of its holders,
+** and the AST functions copy a node someone else
+** also holds before changing it. The table is direct
+** mapped, a colliding entry simply evicting the older
+** one, and the bytes its entries hold are capped, past
+** which they are evicted in turn. An AST node counts
+** against the entry that first held it. The key
+** includes whether errors are suppressed and whether
+** backtracking is on, since both change the result.
+*/
+
+typedef struct {
+  long refs;
+  long held;
+} mpc_ast_ref_t;
+
+typedef struct mpc_memo_t {
+  mpc_parser_t *parser;
+  long pos;
+  int mode;
+  int ok;
+  long end;
+  char last;
+  size_t bytes;
+  mpc_ast_t *output;
+  mpc_err_t *error;
+  mpc_err_t *far;
+} mpc_memo_t;
+
+enum {
+  MPC_MEMO_MIN = 256,
+  MPC_MEMO_MAX = 1 << 20,
+  MPC_MEMO_BYTES = 1 << 26
+};
+
+static mpc_ast_ref_t *mpc_ast_ref(mpc_ast_t *a) {
+  return (mpc_ast_ref_t*)a - 1;
+}
+
+static mpc_ast_t *mpc_ast_share(mpc_ast_t *a) {
+  if (a) { mpc_ast_ref(a)->refs++; }
+  return a;
+}
+
+/* Give a node no one else holds, copying a if it is shared */
+static mpc_ast_t *mpc_ast_own(mpc_ast_t *a) {
+  int j;
+  mpc_ast_t *c;
+  if (a == NULL || mpc_ast_ref(a)->refs == 1) { return a; }
+  c = mpc_ast_new(a->tag, a->contents);
+  c->state = a->state;
+  c->children_num = a->children_num;
+  c->children = a->children_num ? malloc(sizeof(mpc_ast_t*) * a->children_num) : NULL;
+  for (j = 0; j < a->children_num; j++) {
+    c->children[j] = mpc_ast_share(a->children[j]);
+  }
+  mpc_ast_ref(a)->refs--;
+  return c;
+}
+
+/* Mark the nodes of a not held by the table before, giving their bytes */
+static size_t mpc_ast_hold(mpc_ast_t *a) {
+  int j;
+  size_t n;
+  if (a == NULL || mpc_ast_ref(a)->held) { return 0; }
+  mpc_ast_ref(a)->held = 1;
+  n = sizeof(mpc_ast_ref_t) + sizeof(mpc_ast_t)
+    + strlen(a->tag) + 1 + strlen(a->contents) + 1
+    + sizeof(mpc_ast_t*) * a->children_num;
+  for (j = 0; j < a->children_num; j++) {
+    n += mpc_ast_hold(a->children[j]);
+  }
+  return n;
+}
+
+static mpc_err_t *mpc_err_copy(mpc_err_t *x) {
+  int j;
+  mpc_err_t *c;
+  if (x == NULL) { return NULL; }
+  c = malloc(sizeof(mpc_err_t));
+  c->state = x->state;
+  c->recieved = x->recieved;
+  c->filename = malloc(strlen(x->filename) + 1);
+  strcpy(c->filename, x->filename);
+  c->failure = NULL;
+  if (x->failure) {
+    c->failure = malloc(strlen(x->failure) + 1);
+    strcpy(c->failure, x->failure);
+  }
+  c->expected_num = x->expected_num;
+  c->expected = malloc(sizeof(char*) * (x->expected_num + 1));
+  for (j = 0; j < x->expected_num; j++) {
+    c->expected[j] = malloc(strlen(x->expected[j]) + 1);
+    strcpy(c->expected[j], x->expected[j]);
+  }
+  return c;
+}
+
+static size_t mpc_err_bytes(mpc_err_t *x) {
+  int j;
+  size_t n;
+  if (x == NULL) { return 0; }
+  n = sizeof(mpc_err_t) + strlen(x->filename) + 1
+    + (x->failure ? strlen(x->failure) + 1 : 0)
+    + sizeof(char*) * (x->expected_num + 1);
+  for (j = 0; j < x->expected_num; j++) {
+    n += strlen(x->expected[j]) + 1;
+  }
+  return n;
+}
+
+static void mpc_memo_clear(mpc_input_t *i, mpc_memo_t *m) {
+  if (m->parser == NULL) { return; }
+  mpc_ast_delete(m->output);
+  if (m->error) { mpc_err_delete(m->error); }
+  if (m->far) { mpc_err_delete(m->far); }
+  i->memo_bytes -= m->bytes;
+  m->parser = NULL;
+  m->bytes = 0;
+  m->output = NULL;
+  m->error = NULL;
+  m->far = NULL;
+}
+
+/* Evict entries in turn until what they hold fits the cap */
+static void mpc_memo_trim(mpc_input_t *i) {
+  while (i->memo_bytes > MPC_MEMO_BYTES) {
+    mpc_memo_clear(i, &i->memo[i->memo_hand]);
+    i->memo_hand = (i->memo_hand + 1) & (i->memo_slots - 1);
+  }
+}
+
+static int mpc_parse_memo(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e) {
+  
+  int x;
+  long pos = i->pos;
+  int mode = (i->suppress > 0) | ((i->backtrack > 0) << 1);
+  size_t h = ((size_t)p / sizeof(mpc_parser_t) * 2654435761u
+           ^ (size_t)pos * 40503u ^ (size_t)mode) & (i->memo_slots - 1);
+  mpc_err_t *before = *e;
+  mpc_memo_t *m = &i->memo[h];
+  
+  if (m->parser == p && m->pos == pos && m->mode == mode) {
+    if (m->far) { *e = mpc_err_merge(i, *e, mpc_err_copy(m->far)); }
+    if (m->ok) {
+      i->pos = m->end;
+      i->last = m->last;
+      r->output = mpc_ast_share(m->output);
+      return 1;
+    }
+    r->error = mpc_err_copy(m->error);
+    return 0;
+  }
+  
+  x = mpc_parse_step(i, p, r, e);
+  
+  /* Anything nested may have taken the slot in the meantime */
+  m = &i->memo[h];
+  mpc_memo_clear(i, m);
+  m->parser = p;
+  m->pos = pos;
+  m->mode = mode;
+  m->ok = x;
+  m->end = i->pos;
+  m->last = i->last;
+  m->output = x ? mpc_ast_share(r->output) : NULL;
+  m->error = x ? NULL : mpc_err_copy(r->error);
+  m->far = *e != before ? mpc_err_copy(*e) : NULL;
+  m->bytes = mpc_ast_hold(m->output) + mpc_err_bytes(m->error) + mpc_err_bytes(m->far);
+  
+  i->memo_bytes += m->bytes;
+  mpc_memo_trim(i);
+  
+  return x;
+}
+
+/*
+** Programs
+**
+** A parser graph can be compiled into a program: a
+** flat array with one instruction per parser, where
+** children are referred to by index rather than by
+** pointer. The program is run by a loop with an
+** explicit stack of frames instead of recursion, so
+** nesting in the input is bounded by memory and not
+** by the C stack. Each frame keeps the progress of
+** one parser, which is resumed once its child has
+** returned. The results are the same as from
+** mpc_parse_run. A program borrows the strings and
+** functions of the graph it was compiled from, so
+** the graph must outlive it.
+*/
+
+typedef struct {
+  char type;
+  int x;
+  int xs;
+  mpc_pdata_t data;
+} mpc_inst_t;
+
+struct mpc_program_t {
+  int insts_num;
+  int insts_slots;
+  mpc_inst_t *insts;
+  int children_num;
+  int children_slots;
+  int *children;
+  mpc_parser_t **parsers;
+};
+
+static int mpc_compile_node(mpc_program_t *prog, mpc_parser_t *p);
+
+static int mpc_compile_child(mpc_program_t *prog, int inst, mpc_parser_t *x) {
+  int c = mpc_compile_node(prog, x);
+  prog->insts[inst].x = c;
+  return c;
+}
+
+static int mpc_compile_node(mpc_program_t *prog, mpc_parser_t *p) {
+  
+  int j, n, c, idx, base;
+  mpc_parser_t **xs;
+  
+  /* Shared and recursive parsers are compiled only once */
+  for (j = 0; j < prog->insts_num; j++) {
+    if (prog->parsers[j] == p) { return j; }
+  }
+  
+  idx = prog->insts_num++;
+  if (prog->insts_num > prog->insts_slots) {
+    prog->insts_slots = prog->insts_slots * 2;
+    prog->insts = realloc(prog->insts, sizeof(mpc_inst_t) * prog->insts_slots);
+    prog->parsers = realloc(prog->parsers, sizeof(mpc_parser_t*) * prog->insts_slots);
+  }
+  
+  prog->parsers[idx] = p;
+  prog->insts[idx].type = p->type;
+  prog->insts[idx].data = p->data;
+  prog->insts[idx].x = -1;
+  prog->insts[idx].xs = -1;
+  
+  switch (p->type) {
+    case MPC_TYPE_EXPECT:   mpc_compile_child(prog, idx, p->data.expect.x); break;
+    case MPC_TYPE_APPLY:    mpc_compile_child(prog, idx, p->data.apply.x); break;
+    case MPC_TYPE_APPLY_TO: mpc_compile_child(prog, idx, p->data.apply_to.x); break;
+    case MPC_TYPE_PREDICT:  mpc_compile_child(prog, idx, p->data.predict.x); break;
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:    mpc_compile_child(prog, idx, p->data.not.x); break;
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:    mpc_compile_child(prog, idx, p->data.repeat.x); break;
+    
+    case MPC_TYPE_OR:
+    case MPC_TYPE_AND:
+      
+      n  = p->type == MPC_TYPE_OR ? p->data.or.n  : p->data.and.n;
+      xs = p->type == MPC_TYPE_OR ? p->data.or.xs : p->data.and.xs;
+      
+      base = prog->children_num;
+      prog->children_num += n;
+      if (prog->children_num > prog->children_slots) {
+        while (prog->children_num > prog->children_slots) { prog->children_slots *= 2; }
+        prog->children = realloc(prog->children, sizeof(int) * prog->children_slots);
+      }
+      prog->insts[idx].xs = base;
+      
+      /* Compiling a child may move both arrays, so index them afresh */
+      for (j = 0; j < n; j++) {
+        c = mpc_compile_node(prog, xs[j]);
+        prog->children[base + j] = c;
+      }
+      
+    break;
+    
+    default: break;
+  }
+  
+  return idx;
+}
+
+mpc_program_t *mpc_compile(mpc_parser_t *p) {
+  mpc_program_t *prog = malloc(sizeof(mpc_program_t));
+  prog->insts_num = 0;
+  prog->insts_slots = 32;
+  prog->insts = malloc(sizeof(mpc_inst_t) * prog->insts_slots);
+  prog->parsers = malloc(sizeof(mpc_parser_t*) * prog->insts_slots);
+  prog->children_num = 0;
+  prog->children_slots = 32;
+  prog->children = malloc(sizeof(int) * prog->children_slots);
+  mpc_compile_node(prog, p);
+  
+  /* The graph is only needed to find shared nodes while compiling */
+  free(prog->parsers);
+  prog->parsers = NULL;
+  return prog;
+}
+
+void mpc_program_delete(mpc_program_t *prog) {
+  free(prog->insts);
+  free(prog->children);
+  free(prog);
+}
+
+/*
+** Results live on a second stack next to the frames
+** and are referred to by index, so growing it never
+** invalidates them. A frame's children put their
+** results above its base and it drops them on return.
+*/
+
+typedef struct {
+  int inst;
+  int phase;
+  int j;
+  int r;
+  int base;
+} mpc_frame_t;
+
+typedef struct {
+  int num;
+  int slots;
+  mpc_frame_t *frames;
+  int results_num;
+  int results_slots;
+  mpc_result_t *results;
+} mpc_frames_t;
+
+static void mpc_frames_push(mpc_frames_t *s, int inst, int r) {
+  mpc_frame_t *f;
+  if (s->num == s->slots) {
+    s->slots *= 2;
+    s->frames = realloc(s->frames, sizeof(mpc_frame_t) * s->slots);
+  }
+  f = &s->frames[s->num++];
+  f->inst = inst;
+  f->phase = 0;
+  f->j = 0;
+  f->r = r;
+  f->base = s->results_num;
+}
+
+static int mpc_frames_reserve(mpc_frames_t *s, int n) {
+  int base = s->results_num;
+  s->results_num += n;
+  if (s->results_num > s->results_slots) {
+    while (s->results_num > s->results_slots) { s->results_slots *= 2; }
+    s->results = realloc(s->results, sizeof(mpc_result_t) * s->results_slots);
+  }
+  return base;
+}
+
+#define MPC_PROGRAM_PRIMITIVE(x) \
+  if (x) { return 1; } \
+  else { r->error = NULL; return 0; }
+
+/* Run a parser without children in place, with no frame of its own */
+static int mpc_program_leaf(mpc_input_t *i, mpc_inst_t *p, mpc_result_t *r) {
+  
+  switch (p->type) {
+    
+    /* Basic Parsers */
+    
+    case MPC_TYPE_ANY:     MPC_PROGRAM_PRIMITIVE(mpc_input_any(i, (char**)&r->output));
+    case MPC_TYPE_SINGLE:  MPC_PROGRAM_PRIMITIVE(mpc_input_char(i, p->data.single.x, (char**)&r->output));
+    case MPC_TYPE_RANGE:   MPC_PROGRAM_PRIMITIVE(mpc_input_range(i, p->data.range.x, p->data.range.y, (char**)&r->output));
+    case MPC_TYPE_ONEOF:   MPC_PROGRAM_PRIMITIVE(mpc_input_oneof(i, p->data.string.set, (char**)&r->output));
+    case MPC_TYPE_NONEOF:  MPC_PROGRAM_PRIMITIVE(mpc_input_noneof(i, p->data.string.set, (char**)&r->output));
+    case MPC_TYPE_SATISFY: MPC_PROGRAM_PRIMITIVE(mpc_input_satisfy(i, p->data.satisfy.f, (char**)&r->output));
+    case MPC_TYPE_STRING:  MPC_PROGRAM_PRIMITIVE(mpc_input_string(i, p->data.string.x, (char**)&r->output));
+    case MPC_TYPE_ANCHOR:  MPC_PROGRAM_PRIMITIVE(mpc_input_anchor(i, p->data.anchor.f, (char**)&r->output));
+    
+    /* Other parsers */
+    
+    case MPC_TYPE_UNDEFINED: r->error = mpc_err_fail(i, "Parser Undefined!"); return 0;
+    case MPC_TYPE_PASS:      r->output = NULL; return 1;
+    case MPC_TYPE_FAIL:      r->error = mpc_err_fail(i, p->data.fail.m); return 0;
+    case MPC_TYPE_LIFT:      r->output = p->data.lift.lf(); return 1;
+    case MPC_TYPE_LIFT_VAL:  r->output = p->data.lift.x; return 1;
+    case MPC_TYPE_STATE:     r->output = mpc_input_state_copy(i); return 1;
+    
+    default: r->error = mpc_err_fail(i, "Unknown Parser Type Id!"); return 0;
+  }
+}
+
+#undef MPC_PROGRAM_PRIMITIVE
+
+/*
+** Start instruction inst with its result in slot r.
+** Leaves finish at once and return whether they
+** matched. Anything else gets a frame, returns -1,
+** and sets ok itself when it is done.
+*/
+static int mpc_program_call(mpc_frames_t *s, mpc_input_t *i, mpc_program_t *prog, int inst, int r) {
+  mpc_inst_t *p = &prog->insts[inst];
+  if (p->type < MPC_TYPE_APPLY && p->type != MPC_TYPE_EXPECT) {
+    return mpc_program_leaf(i, p, &s->results[r]);
+  }
+  mpc_frames_push(s, inst, r);
+  return -1;
+}
+
+static int mpc_program_run(mpc_input_t *i, mpc_program_t *prog, mpc_result_t *r, mpc_err_t **e) {
+  
+  int k, n, ok = 0;
+  char *m;
+  mpc_frame_t *f;
+  mpc_inst_t *p, *c;
+  mpc_result_t *y, *ys;
+  mpc_frames_t s;
+  
+  s.num = 0;
+  s.slots = 64;
+  s.frames = malloc(sizeof(mpc_frame_t) * s.slots);
+  s.results_num = 0;
+  s.results_slots = 256;
+  s.results = malloc(sizeof(mpc_result_t) * s.results_slots);
+  ok = mpc_program_call(&s, i, prog, 0, mpc_frames_reserve(&s, 1));
+  
+  /*
+  ** Each pass of the loop runs the frame on top. A
+  ** frame either starts a child and moves to its next
+  ** phase, or sets ok and its result and is popped,
+  ** in which case its parent runs next and reads ok.
+  ** A leaf child sets ok as soon as it is started.
+  */
+  while (s.num > 0) {
+    
+    f = &s.frames[s.num-1];
+    p = &prog->insts[f->inst];
+    y = &s.results[f->r];
+    ys = &s.results[f->base];
+    
+    switch (p->type) {
       
-      results = p->data.repeat.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.repeat.n)
-        : results_stk;
+      /* Application Parsers */
       
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e)) {
-        j++;
-        if (j == p->data.repeat.n) { break; }
-      }
+      case MPC_TYPE_APPLY:
+        if (f->phase == 0) { f->phase = 1; ok = mpc_program_call(&s, i, prog, p->x, f->r); continue; }
+        if (ok) { y->output = mpc_parse_apply(i, p->data.apply.f, y->output); }
+      break;
       
-      if (j == p->data.repeat.n) {
-        MPC_SUCCESS(
-          mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-          if (p->data.repeat.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      } else {
-        for (k = 0; k < j; k++) {
-          mpc_parse_dtor(i, p->data.repeat.dx, results[k].output);
+      case MPC_TYPE_APPLY_TO:
+        if (f->phase == 0) { f->phase = 1; ok = mpc_program_call(&s, i, prog, p->x, f->r); continue; }
+        if (ok) { y->output = mpc_parse_apply_to(i, p->data.apply_to.f, y->output, p->data.apply_to.d); }
+      break;
+      
+      case MPC_TYPE_EXPECT:
+        if (f->phase == 0) {
+          mpc_input_suppress_enable(i);
+          f->phase = 1; ok = mpc_program_call(&s, i, prog, p->x, f->r); continue;
         }
-        MPC_FAILURE(
-          mpc_err_count(i, results[j].error, p->data.repeat.n);
-          if (p->data.repeat.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });  
-      }
+        mpc_input_suppress_disable(i);
+        if (!ok) { y->error = mpc_err_new(i, p->data.expect.m); }
+      break;
       
-    /* Combinatory Parsers */
-    
-    case MPC_TYPE_OR:
+      case MPC_TYPE_PREDICT:
+        if (f->phase == 0) {
+          mpc_input_backtrack_disable(i);
+          f->phase = 1; ok = mpc_program_call(&s, i, prog, p->x, f->r); continue;
+        }
+        mpc_input_backtrack_enable(i);
+      break;
       
-      if (p->data.or.n == 0) { MPC_SUCCESS(NULL); }
+      /* Optional Parsers */
       
-      results = p->data.or.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
-        : results_stk;
+      case MPC_TYPE_NOT:
+        if (f->phase == 0) {
+          mpc_input_mark(i);
+          mpc_input_suppress_enable(i);
+          f->phase = 1; ok = mpc_program_call(&s, i, prog, p->x, f->r); continue;
+        }
+        if (ok) {
+          mpc_input_rewind(i);
+          mpc_input_suppress_disable(i);
+          mpc_parse_dtor(i, p->data.not.dx, y->output);
+          ok = 0; y->error = mpc_err_new(i, "opposite");
+        } else {
+          mpc_input_unmark(i);
+          mpc_input_suppress_disable(i);
+          ok = 1; y->output = p->data.not.lf();
+        }
+      break;
       
-      for (j = 0; j < p->data.or.n; j++) {
-        if (mpc_parse_run(i, p->data.or.xs[j], &results[j], e)) {
-          MPC_SUCCESS(results[j].output;
-            if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+      case MPC_TYPE_MAYBE:
+        if (f->phase == 0) { f->phase = 1; ok = mpc_program_call(&s, i, prog, p->x, f->r); continue; }
+        if (!ok) {
+          *e = mpc_err_merge(i, *e, y->error);
+          ok = 1; y->output = p->data.not.lf();
+        }
+      break;
+      
+      /* Repeat Parsers */
+      
+      case MPC_TYPE_MANY:
+      case MPC_TYPE_MANY1:
+        
+        if (p->data.repeat.f == mpcf_strfold) {
+          c = &prog->insts[p->x];
+          m = c->type == MPC_TYPE_EXPECT ? c->data.expect.m : NULL;
+          while (c->type == MPC_TYPE_EXPECT) { c = &prog->insts[c->x]; }
+          if (mpc_class_parser(c->type)) {
+            ok = mpc_parse_class(i, p->type == MPC_TYPE_MANY1, c->type, &c->data, m, y, e);
+            break;
+          }
+        }
+        
+        if (f->phase == 0) {
+          f->phase = 1; ok = mpc_program_call(&s, i, prog, p->x, mpc_frames_reserve(&s, 1)); continue;
+        }
+        
+        if (ok) {
+          f->j++;
+          ok = mpc_program_call(&s, i, prog, p->x, mpc_frames_reserve(&s, 1)); continue;
+        }
+        
+        if (p->type == MPC_TYPE_MANY1 && f->j == 0) {
+          ok = 0; y->error = mpc_err_many1(i, ys[f->j].error);
         } else {
-          *e = mpc_err_merge(i, *e, results[j].error);
-        } 
-      }
+          *e = mpc_err_merge(i, *e, ys[f->j].error);
+          ok = 1; y->output = mpc_parse_fold(i, p->data.repeat.f, f->j, (mpc_val_t**)ys);
+        }
+        
+      break;
       
-      MPC_FAILURE(NULL;
-        if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-    
-    case MPC_TYPE_AND:
+      case MPC_TYPE_COUNT:
+        
+        n = p->data.repeat.n;
+        
+        if (f->phase == 0) {
+          mpc_frames_reserve(&s, n > 0 ? n : 1);
+          f->phase = 1; ok = mpc_program_call(&s, i, prog, p->x, f->base); continue;
+        }
+        
+        if (ok) {
+          f->j++;
+          if (f->j < n) { ok = mpc_program_call(&s, i, prog, p->x, f->base + f->j); continue; }
+          ok = 1; y->output = mpc_parse_fold(i, p->data.repeat.f, f->j, (mpc_val_t**)ys);
+        } else {
+          for (k = 0; k < f->j; k++) {
+            mpc_parse_dtor(i, p->data.repeat.dx, ys[k].output);
+          }
+          ok = 0; y->error = mpc_err_count(i, ys[f->j].error, n);
+        }
+        
+      break;
       
-      if (p->data.and.n == 0) { MPC_SUCCESS(NULL); }
+      /* Combinatory Parsers */
       
-      results = p->data.or.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
-        : results_stk;
+      case MPC_TYPE_OR:
+        
+        n = p->data.or.n;
+        
+        if (f->phase == 0) {
+          if (n == 0) { ok = 1; y->output = NULL; break; }
+          mpc_frames_reserve(&s, n);
+          f->phase = 1; ok = mpc_program_call(&s, i, prog, prog->children[p->xs], f->base); continue;
+        }
+        
+        if (ok) {
+          y->output = ys[f->j].output;
+        } else {
+          *e = mpc_err_merge(i, *e, ys[f->j].error);
+          f->j++;
+          if (f->j < n) { ok = mpc_program_call(&s, i, prog, prog->children[p->xs + f->j], f->base + f->j); continue; }
+          y->error = NULL;
+        }
+        
+      break;
       
-      mpc_input_mark(i);
-      for (j = 0; j < p->data.and.n; j++) {
-        if (!mpc_parse_run(i, p->data.and.xs[j], &results[j], e)) {
+      case MPC_TYPE_AND:
+        
+        n = p->data.and.n;
+        
+        if (f->phase == 0) {
+          if (n == 0) { ok = 1; y->output = NULL; break; }
+          mpc_frames_reserve(&s, n);
+          mpc_input_mark(i);
+          f->phase = 1; ok = mpc_program_call(&s, i, prog, prog->children[p->xs], f->base); continue;
+        }
+        
+        if (ok) {
+          f->j++;
+          if (f->j < n) { ok = mpc_program_call(&s, i, prog, prog->children[p->xs + f->j], f->base + f->j); continue; }
+          mpc_input_unmark(i);
+          y->output = mpc_parse_fold(i, p->data.and.f, f->j, (mpc_val_t**)ys);
+        } else {
           mpc_input_rewind(i);
-          for (k = 0; k < j; k++) {
-            mpc_parse_dtor(i, p->data.and.dxs[k], results[k].output);
+          for (k = 0; k < f->j; k++) {
+            mpc_parse_dtor(i, p->data.and.dxs[k], ys[k].output);
           }
-          MPC_FAILURE(results[j].error;
-            if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+          y->error = ys[f->j].error;
         }
-      }
-      mpc_input_unmark(i); 
-      MPC_SUCCESS(
-        mpc_parse_fold(i, p->data.and.f, j, (mpc_val_t**)results);
-        if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-    
-    /* End */
-    
-    default:
+        
+      break;
       
-      MPC_FAILURE(mpc_err_fail(i, "Unknown Parser Type Id!"));
+      /* End */
+      
+      default:
+        ok = 0; y->error = mpc_err_fail(i, "Unknown Parser Type Id!");
+      break;
+    }
+    
+    s.results_num = f->base;
+    s.num--;
   }
   
-  return 0;
-  
+  *r = s.results[0];
+  free(s.results);
+  free(s.frames);
+  return ok;
 }
 
-#undef MPC_SUCCESS
-#undef MPC_FAILURE
-#undef MPC_PRIMITIVE
+static int mpc_parse_input_program(mpc_input_t *i, mpc_program_t *prog, mpc_result_t *r) {
+  int x;
+  mpc_err_t *e = mpc_err_fail(i, "Unknown Error");
+  e->state = mpc_state_invalid();
+  x = mpc_program_run(i, prog, r, &e);
+  if (x) {
+    mpc_err_delete_internal(i, e);
+    r->output = mpc_export(i, r->output);
+  } else {
+    r->error = mpc_err_export(i, mpc_err_merge(i, e, r->error));
+  }
+  return x;
+}
+
+int mpc_parse_program(const char *filename, const char *string, size_t length, mpc_program_t *prog, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_view(filename, string, length);
+  x = mpc_parse_input_program(i, prog, r);
+  mpc_input_delete(i);
+  return x;
+}
 
 int mpc_parse_input(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
   int x;
@@ -1262,6 +2276,32 @@ int mpc_nparse(const char *filename, const char *string, size_t length, mpc_pars
   return x;
 }
 
+int mpc_parse_view(const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_view(filename, string, length);
+  x = mpc_parse_input(i, p, r);
+  mpc_input_delete(i);
+  return x;
+}
+
+int mpc_parse_packrat(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  size_t j;
+  mpc_input_t *i = mpc_input_new_string(filename, string);
+  
+  /* One slot per input byte, give or take, within the cap */
+  i->memo_slots = MPC_MEMO_MIN;
+  while (i->memo_slots < i->length && i->memo_slots < MPC_MEMO_MAX) { i->memo_slots *= 2; }
+  i->memo = calloc(i->memo_slots, sizeof(mpc_memo_t));
+  
+  x = mpc_parse_input(i, p, r);
+  
+  for (j = 0; j < i->memo_slots; j++) { mpc_memo_clear(i, &i->memo[j]); }
+  free(i->memo);
+  mpc_input_delete(i);
+  return x;
+}
+
 int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r) {
   int x;
   mpc_input_t *i = mpc_input_new_file(filename, file);
@@ -1278,10 +2318,283 @@ int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result
   return x;
 }
 
+/*
+** Feeding
+**
+** A feed holds the bytes pushed into it that have
+** not yet been parsed. Each call to next parses one
+** item from the front of them as a view. A result
+** that looked at the end of the bytes may change
+** once more arrive, so it is thrown away and next
+** reports that it needs more input, until the feed
+** has been told the input has ended. So is an item
+** that matched no input at all, which is an error
+** once the input has ended, as otherwise the same
+** empty item would be found forever.
+**
+** Parsing again from the front each time more bytes
+** arrive costs time quadratic in the length of an
+** item spread over many pushes. For grammars whose
+** items nest by a pair of characters, which never
+** appear unpaired inside strings or comments, the
+** feed can be told that pair, and then scans each
+** item just once to find where it closes, and does
+** not parse it again until it might have.
+**
+** The parser recurses in C for each level an item
+** nests, so a feed may also be given the compiled
+** program of its parser, which keeps its own stack,
+** to parse items nesting at least some depth with.
+** Without a nesting pair every item is run on it.
+*/
+
+struct mpc_feed_t {
+  char *filename;
+  mpc_parser_t *parser;
+  mpc_dtor_t destructor;
+  char *buffer;
+  size_t length;
+  size_t slots;
+  size_t consumed;
+  mpc_state_t state;
+  char last;
+  int ended;
+  char open;
+  char close;
+  size_t scan;
+  long depth;
+  long deepest;
+  mpc_program_t *program;
+  long program_depth;
+};
+
+mpc_feed_t *mpc_feed_new(const char *filename, mpc_parser_t *p, mpc_dtor_t d) {
+  mpc_feed_t *f = malloc(sizeof(mpc_feed_t));
+  f->filename = malloc(strlen(filename) + 1);
+  strcpy(f->filename, filename);
+  f->parser = p;
+  f->destructor = d;
+  f->buffer = NULL;
+  f->length = 0;
+  f->slots = 0;
+  f->consumed = 0;
+  f->state = mpc_state_new();
+  f->last = '\0';
+  f->ended = 0;
+  f->open = '\0';
+  f->close = '\0';
+  f->scan = 0;
+  f->depth = 0;
+  f->deepest = 0;
+  f->program = NULL;
+  f->program_depth = 0;
+  return f;
+}
+
+void mpc_feed_delete(mpc_feed_t *f) {
+  free(f->filename);
+  free(f->buffer);
+  free(f);
+}
+
+void mpc_parser_feed(mpc_feed_t *f, const char *bytes, size_t length) {
+  
+  /* Drop parsed bytes once they are at least half the buffer */
+  if (f->consumed > 0 && f->consumed >= f->length / 2) {
+    memmove(f->buffer, f->buffer + f->consumed, f->length - f->consumed);
+    f->length -= f->consumed;
+    f->scan -= f->consumed;
+    f->consumed = 0;
+  }
+  
+  if (f->length + length > f->slots) {
+    f->slots = f->slots ? f->slots : MPC_INPUT_BUFFER_MIN;
+    while (f->length + length > f->slots) { f->slots *= 2; }
+    f->buffer = realloc(f->buffer, f->slots);
+  }
+  
+  memcpy(f->buffer + f->length, bytes, length);
+  f->length += length;
+}
+
+void mpc_feed_end(mpc_feed_t *f) {
+  f->ended = 1;
+}
+
+void mpc_feed_nesting(mpc_feed_t *f, char open, char close) {
+  f->open = open;
+  f->close = close;
+}
+
+void mpc_feed_program(mpc_feed_t *f, mpc_program_t *prog, int depth) {
+  f->program = prog;
+  f->program_depth = depth;
+}
+
+/*
+** Scan on from where the last call stopped, and say
+** if the item at the front of the feed may be whole,
+** which is once it has closed as often as it opened.
+*/
+static int mpc_feed_closed(mpc_feed_t *f) {
+  
+  char c;
+  
+  if (f->open == '\0') { return 1; }
+  
+  while (f->scan < f->length) {
+    c = f->buffer[f->scan++];
+    if (c == f->open && ++f->depth > f->deepest) { f->deepest = f->depth; }
+    else if (c == f->close) { f->depth--; }
+    if (f->depth <= 0 && !isspace((unsigned char)c)) { return 1; }
+  }
+  
+  return f->depth <= 0;
+}
+
+static void mpc_feed_advance(mpc_feed_t *f, size_t n) {
+  
+  const char *start, *line, *nl;
+  if (n == 0) { return; }
+  
+  start = line = f->buffer + f->consumed;
+  while ((nl = memchr(line, '\n', (size_t)(start + n - line))) != NULL) {
+    f->state.row++;
+    line = nl + 1;
+  }
+  f->state.col = line == start ? f->state.col + (long)n : (long)(start + n - line);
+  
+  f->last = start[n-1];
+  f->state.pos += (long)n;
+  f->consumed += n;
+  f->scan = f->consumed;
+  f->depth = 0;
+  f->deepest = 0;
+}
+
+int mpc_feed_next(mpc_feed_t *f, mpc_result_t *r) {
+  
+  int x, touched;
+  size_t j, n;
+  mpc_input_t *i;
+  
+  /* Whitespace after the last item is not an item */
+  if (f->ended) {
+    for (j = f->consumed; j < f->length; j++) {
+      if (!isspace((unsigned char)f->buffer[j])) { break; }
+    }
+    if (j == f->length) {
+      mpc_feed_advance(f, f->length - f->consumed);
+      return MPC_FEED_DONE;
+    }
+  }
+  
+  if (f->consumed == f->length) { return MPC_FEED_MORE; }
+  if (!mpc_feed_closed(f) && !f->ended) { return MPC_FEED_MORE; }
+  
+  i = mpc_input_new_view(f->filename, f->buffer + f->consumed, f->length - f->consumed);
+  i->origin.row = f->state.row;
+  i->origin.col = f->state.col;
+  i->last = f->last;
+  
+  if (f->program && (f->open == '\0' || f->deepest >= f->program_depth)) {
+    x = mpc_parse_input_program(i, f->program, r);
+  } else {
+    x = mpc_parse_input(i, f->parser, r);
+  }
+  touched = i->touched;
+  n = (size_t)i->pos;
+  mpc_input_delete(i);
+  
+  if (touched && !f->ended) {
+    if (x) { f->destructor(r->output); } else { mpc_err_delete(r->error); }
+    r->output = NULL;
+    return MPC_FEED_MORE;
+  }
+  
+  /* An item that takes no input would be found again and again */
+  if (x && n == 0) {
+    f->destructor(r->output);
+    r->output = NULL;
+    if (!f->ended) { return MPC_FEED_MORE; }
+    r->error = mpc_err_file(f->filename, "item matched no input");
+    r->error->state = f->state;
+    mpc_feed_advance(f, f->length - f->consumed);
+    return MPC_FEED_ERROR;
+  }
+  
+  if (x) {
+    mpc_feed_advance(f, n);
+    return MPC_FEED_OUTPUT;
+  }
+  
+  /* Report the error against the whole stream and skip what is left */
+  r->error->state.pos += f->state.pos;
+  mpc_feed_advance(f, f->length - f->consumed);
+  return MPC_FEED_ERROR;
+}
+
+/*
+** Regular files are mapped so they can be parsed in
+** place as a view. Anything that cannot be mapped,
+** such as a pipe or a device, gives NULL, and should
+** be read through stdio instead.
+*/
+const char *mpc_contents_map(const char *filename, size_t *length) {
+  
+#ifdef MPC_USE_MMAP
+  int fd;
+  struct stat st;
+  void *m;
+  
+  fd = open(filename, O_RDONLY);
+  if (fd < 0) { return NULL; }
+  
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    if (st.st_size == 0) {
+      close(fd);
+      *length = 0;
+      return "";
+    }
+    m = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (m != MAP_FAILED) {
+      close(fd);
+      *length = (size_t)st.st_size;
+      return m;
+    }
+  }
+  close(fd);
+#else
+  (void)filename;
+  (void)length;
+#endif
+  
+  return NULL;
+}
+
+void mpc_contents_unmap(const char *contents, size_t length) {
+#ifdef MPC_USE_MMAP
+  if (length > 0) { munmap((void*)contents, length); }
+#else
+  (void)contents;
+  (void)length;
+#endif
+}
+
 int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
   
-  FILE *f = fopen(filename, "rb");
+  FILE *f;
   int res;
+  size_t length;
+  const char *m = mpc_contents_map(filename, &length);
+  
+  if (m != NULL) {
+    res = mpc_parse_view(filename, m, length, p, r);
+    mpc_contents_unmap(m, length);
+    return res;
+  }
+  
+  f = fopen(filename, "rb");
   
   if (f == NULL) {
     r->output = NULL;
@@ -1333,6 +2646,7 @@ static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
     case MPC_TYPE_NONEOF:
     case MPC_TYPE_STRING:
       free(p->data.string.x); 
+      free(p->data.string.set);
       break;
     
     case MPC_TYPE_APPLY:    mpc_undefine_unretained(p->data.apply.x, 0);    break;
@@ -1431,6 +2745,7 @@ mpc_parser_t *mpc_copy(mpc_parser_t *a) {
     case MPC_TYPE_STRING:
       p->data.string.x = malloc(strlen(a->data.string.x)+1);
       strcpy(p->data.string.x, a->data.string.x);
+      p->data.string.set = a->data.string.set ? mpc_set_new(a->data.string.x) : NULL;
       break;
     
     case MPC_TYPE_APPLY:    p->data.apply.x    = mpc_copy(a->data.apply.x);    break;
@@ -1486,6 +2801,12 @@ mpc_parser_t *mpc_undefine(mpc_parser_t *p) {
 
 mpc_parser_t *mpc_define(mpc_parser_t *p, mpc_parser_t *a) {
   
+  /* Other threads may be parsing with a frozen parser, so it stays as it is */
+  if (p->frozen) {
+    mpc_delete(a);
+    return NULL;
+  }
+  
   if (p->retained) {
     p->type = a->type;
     p->data = a->data;
@@ -1671,6 +2992,7 @@ mpc_parser_t *mpc_oneof(const char *s) {
   p->type = MPC_TYPE_ONEOF;
   p->data.string.x = malloc(strlen(s) + 1);
   strcpy(p->data.string.x, s);
+  p->data.string.set = mpc_set_new(s);
   return mpc_expectf(p, "one of '%s'", s);
 }
 
@@ -1679,6 +3001,7 @@ mpc_parser_t *mpc_noneof(const char *s) {
   p->type = MPC_TYPE_NONEOF;
   p->data.string.x = malloc(strlen(s) + 1);
   strcpy(p->data.string.x, s);
+  p->data.string.set = mpc_set_new(s);
   return mpc_expectf(p, "none of '%s'", s);
 
 }
@@ -1695,6 +3018,7 @@ mpc_parser_t *mpc_string(const char *s) {
   p->type = MPC_TYPE_STRING;
   p->data.string.x = malloc(strlen(s) + 1);
   strcpy(p->data.string.x, s);
+  p->data.string.set = NULL;
   return mpc_expectf(p, "\"%s\"", s);
 }
 
@@ -1864,7 +3188,8 @@ mpc_parser_t *mpc_lower(void) { return mpc_expect(mpc_oneof("abcdefghijklmnopqrs
 mpc_parser_t *mpc_upper(void) { return mpc_expect(mpc_oneof("ABCDEFGHIJKLMNOPQRSTUVWXYZ"), "uppercase letter"); }
 mpc_parser_t *mpc_alpha(void) { return mpc_expect(mpc_oneof("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ"), "letter"); }
 mpc_parser_t *mpc_underscore(void) { return mpc_expect(mpc_char('_'), "underscore"); }
-mpc_parser_t *mpc_alphanum(void) { return mpc_expect(mpc_or(3, mpc_alpha(), mpc_digit(), mpc_underscore()), "alphanumeric"); }
+/* One class rather than an or of three, so runs of it are scanned whole */
+mpc_parser_t *mpc_alphanum(void) { return mpc_expect(mpc_oneof("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_"), "alphanumeric"); }
 
 mpc_parser_t *mpc_int(void) { return mpc_expect(mpc_apply(mpc_digits(), mpcf_int), "integer"); }
 mpc_parser_t *mpc_hex(void) { return mpc_expect(mpc_apply(mpc_hexdigits(), mpcf_hex), "hexadecimal"); }
@@ -2093,32 +3418,42 @@ static const char *mpc_re_range_escape_char(char c) {
   }
 }
 
+/* Append c to the range being built, growing it geometrically */
+static char *mpc_re_range_push(char *range, size_t *n, size_t *slots, char c) {
+  if (c == '\0') { return range; }
+  if (*n + 1 == *slots) {
+    *slots *= 2;
+    range = realloc(range, *slots);
+  }
+  range[(*n)++] = c;
+  range[*n] = '\0';
+  return range;
+}
+
 static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
   
   mpc_parser_t *out;
-  size_t i, j;
+  size_t i, j, l;
   size_t start, end;
+  size_t n = 0, slots = 64;
   const char *tmp = NULL;
   const char *s = x;
   int comp = s[0] == '^' ? 1 : 0;
-  char *range = calloc(1,1);
+  char *range = calloc(1, slots);
   
-  if (s[0] == '\0') { free(x); return mpc_fail("Invalid Regex Range Expression"); } 
+  if (s[0] == '\0') { free(range); free(x); return mpc_fail("Invalid Regex Range Expression"); } 
   if (s[0] == '^' && 
-      s[1] == '\0') { free(x); return mpc_fail("Invalid Regex Range Expression"); }
+      s[1] == '\0') { free(range); free(x); return mpc_fail("Invalid Regex Range Expression"); }
   
-  for (i = comp; i < strlen(s); i++){
+  for (i = comp, l = strlen(s); i < l; i++){
     
     /* Regex Range Escape */
     if (s[i] == '\\') {
       tmp = mpc_re_range_escape_char(s[i+1]);
       if (tmp != NULL) {
-        range = realloc(range, strlen(range) + strlen(tmp) + 1);
-        strcat(range, tmp);
+        for (; *tmp; tmp++) { range = mpc_re_range_push(range, &n, &slots, *tmp); }
       } else {
-        range = realloc(range, strlen(range) + 1 + 1);
-        range[strlen(range) + 1] = '\0';
-        range[strlen(range) + 0] = s[i+1];      
+        range = mpc_re_range_push(range, &n, &slots, s[i+1]);
       }
       i++;
     }
@@ -2126,24 +3461,19 @@ static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
     /* Regex Range...Range */
     else if (s[i] == '-') {
       if (s[i+1] == '\0' || i == 0) {
-          range = realloc(range, strlen(range) + strlen("-") + 1);
-          strcat(range, "-");
+          range = mpc_re_range_push(range, &n, &slots, '-');
       } else {
         start = s[i-1]+1;
         end = s[i+1]-1;
         for (j = start; j <= end; j++) {
-          range = realloc(range, strlen(range) + 1 + 1 + 1);
-          range[strlen(range) + 1] = '\0';
-          range[strlen(range) + 0] = (char)j;
+          range = mpc_re_range_push(range, &n, &slots, (char)j);
         }        
       }
     }
     
     /* Regex Range Normal */
     else {
-      range = realloc(range, strlen(range) + 1 + 1);
-      range[strlen(range) + 1] = '\0';
-      range[strlen(range) + 0] = s[i];
+      range = mpc_re_range_push(range, &n, &slots, s[i]);
     }
   
   }
@@ -2442,18 +3772,24 @@ mpc_val_t *mpcf_trd_free(int n, mpc_val_t **xs) { return mpcf_nth_free(n, xs, 2)
 
 mpc_val_t *mpcf_strfold(int n, mpc_val_t **xs) {
   int i;
-  size_t l = 0;
+  size_t l = 0, k;
+  char *end;
   
   if (n == 0) { return calloc(1, 1); }
   
   for (i = 0; i < n; i++) { l += strlen(xs[i]); }
   
+  k = strlen(xs[0]);
   xs[0] = realloc(xs[0], l + 1);
+  end = (char*)xs[0] + k;
   
   for (i = 1; i < n; i++) {
-    strcat(xs[0], xs[i]); free(xs[i]);
+    k = strlen(xs[i]);
+    memcpy(end, xs[i], k); free(xs[i]);
+    end += k;
   }
   
+  *end = '\0';
   return xs[0];
 }
 
@@ -2670,6 +4006,7 @@ void mpc_ast_delete(mpc_ast_t *a) {
   int i;
   
   if (a == NULL) { return; }
+  if (--mpc_ast_ref(a)->refs > 0) { return; }
   
   for (i = 0; i < a->children_num; i++) {
     mpc_ast_delete(a->children[i]);
@@ -2678,7 +4015,7 @@ void mpc_ast_delete(mpc_ast_t *a) {
   free(a->children);
   free(a->tag);
   free(a->contents);
-  free(a);
+  free(mpc_ast_ref(a));
   
 }
 
@@ -2686,12 +4023,16 @@ static void mpc_ast_delete_no_children(mpc_ast_t *a) {
   free(a->children);
   free(a->tag);
   free(a->contents);
-  free(a);
+  free(mpc_ast_ref(a));
 }
 
 mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
   
-  mpc_ast_t *a = malloc(sizeof(mpc_ast_t));
+  mpc_ast_ref_t *n = malloc(sizeof(mpc_ast_ref_t) + sizeof(mpc_ast_t));
+  mpc_ast_t *a = (mpc_ast_t*)(n + 1);
+  
+  n->refs = 1;
+  n->held = 0;
   
   a->tag = malloc(strlen(tag) + 1);
   strcpy(a->tag, tag);
@@ -2754,6 +4095,7 @@ int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b) {
 }
 
 mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a) {
+  r = mpc_ast_own(r);
   r->children_num++;
   r->children = realloc(r->children, sizeof(mpc_ast_t*) * r->children_num);
   r->children[r->children_num-1] = a;
@@ -2762,6 +4104,7 @@ mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a) {
 
 mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
   if (a == NULL) { return a; }
+  a = mpc_ast_own(a);
   a->tag = realloc(a->tag, strlen(t) + 1 + strlen(a->tag) + 1);
   memmove(a->tag + strlen(t) + 1, a->tag, strlen(a->tag)+1);
   memmove(a->tag, t, strlen(t));
@@ -2771,6 +4114,7 @@ mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
 
 mpc_ast_t *mpc_ast_add_root_tag(mpc_ast_t *a, const char *t) {
   if (a == NULL) { return a; }
+  a = mpc_ast_own(a);
   a->tag = realloc(a->tag, (strlen(t)-1) + strlen(a->tag) + 1);
   memmove(a->tag + (strlen(t)-1), a->tag, strlen(a->tag)+1);
   memmove(a->tag, t, (strlen(t)-1));
@@ -2778,6 +4122,7 @@ mpc_ast_t *mpc_ast_add_root_tag(mpc_ast_t *a, const char *t) {
 }
 
 mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t) {
+  a = mpc_ast_own(a);
   a->tag = realloc(a->tag, strlen(t) + 1);
   strcpy(a->tag, t);
   return a;
@@ -2785,6 +4130,7 @@ mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t) {
 
 mpc_ast_t *mpc_ast_state(mpc_ast_t *a, mpc_state_t s) {
   if (a == NULL) { return a; }
+  a = mpc_ast_own(a);
   a->state = s;
   return a;
 }
@@ -3008,6 +4354,9 @@ mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
     
     if (as[i] == NULL) { continue; }
     
+    /* Children are taken out of their parent, which must not be shared */
+    if (as[i]->children_num > 0) { as[i] = mpc_ast_own(as[i]); }
+    
     if        (as[i] && as[i]->children_num == 0) {
       mpc_ast_add_child(r, as[i]);
     } else if (as[i] && as[i]->children_num == 1) {
@@ -3428,6 +4777,7 @@ static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
     stmt = *stmts;
     left = mpca_grammar_find_parser(stmt->ident, st);
     if (st->flags & MPCA_LANG_PREDICTIVE) { stmt->grammar = mpc_predictive(stmt->grammar); }
+    if (st->flags & MPCA_LANG_PACKRAT) { left->packrat = 1; }
     if (stmt->name) { stmt->grammar = mpc_expect(stmt->grammar, stmt->name); }
     mpc_optimise(stmt->grammar);
     mpc_define(left, stmt->grammar);
@@ -3663,6 +5013,7 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
   mpc_parser_t *t;
   
   if (p->retained && !force) { return; }
+  if (p->frozen) { return; }
   
   /* Optimise Subexpressions */
   
@@ -3828,3 +5179,52 @@ void mpc_optimise(mpc_parser_t *p) {
   mpc_optimise_unretained(p, 1);
 }
 
+/*
+** Freezing
+**
+** Parsing never writes to a parser. All of its state
+** is kept in the input, so any number of threads can
+** parse with the same grammar at once, as long as no
+** thread changes the grammar while they do. Freezing
+** makes that explicit. Every rule reachable from p is
+** optimised one last time and marked frozen, and from
+** then on mpc_optimise leaves it alone and mpc_define
+** refuses to replace it, deleting the new definition
+** and returning NULL. A frozen grammar is deleted
+** as usual, once no thread is parsing with it. Any
+** program compiled from it can be shared the same way.
+*/
+
+static void mpc_freeze_unretained(mpc_parser_t *p, int force) {
+  
+  int j;
+  
+  if (p->frozen) { return; }
+  if (p->retained || force) { mpc_optimise_unretained(p, 1); }
+  p->frozen = 1;
+  
+  switch (p->type) {
+    case MPC_TYPE_EXPECT:   mpc_freeze_unretained(p->data.expect.x, 0); break;
+    case MPC_TYPE_APPLY:    mpc_freeze_unretained(p->data.apply.x, 0); break;
+    case MPC_TYPE_APPLY_TO: mpc_freeze_unretained(p->data.apply_to.x, 0); break;
+    case MPC_TYPE_PREDICT:  mpc_freeze_unretained(p->data.predict.x, 0); break;
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:    mpc_freeze_unretained(p->data.not.x, 0); break;
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:    mpc_freeze_unretained(p->data.repeat.x, 0); break;
+    case MPC_TYPE_OR:
+      for (j = 0; j < p->data.or.n; j++) { mpc_freeze_unretained(p->data.or.xs[j], 0); }
+      break;
+    case MPC_TYPE_AND:
+      for (j = 0; j < p->data.and.n; j++) { mpc_freeze_unretained(p->data.and.xs[j], 0); }
+      break;
+    default: break;
+  }
+  
+}
+
+void mpc_freeze(mpc_parser_t *p) {
+  mpc_freeze_unretained(p, 1);
+}
+
@@ -66,9 +66,14 @@ typedef struct mpc_parser_t mpc_parser_t;
 
 int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r);
 int mpc_nparse(const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r);
+int mpc_parse_view(const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r);
+int mpc_parse_packrat(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r);
+
+const char *mpc_contents_map(const char *filename, size_t *length);
+void mpc_contents_unmap(const char *contents, size_t length);
 
 /*
 ** Function Types
@@ -81,6 +86,50 @@ typedef mpc_val_t*(*mpc_apply_t)(mpc_val_t*);
 typedef mpc_val_t*(*mpc_apply_to_t)(mpc_val_t*,void*);
 typedef mpc_val_t*(*mpc_fold_t)(int,mpc_val_t**);
 
+/*
+** Feeding
+*/
+
+enum {
+  MPC_FEED_MORE   = 0,
+  MPC_FEED_OUTPUT = 1,
+  MPC_FEED_ERROR  = 2,
+  MPC_FEED_DONE   = 3
+};
+
+struct mpc_feed_t;
+typedef struct mpc_feed_t mpc_feed_t;
+
+mpc_feed_t *mpc_feed_new(const char *filename, mpc_parser_t *p, mpc_dtor_t d);
+void mpc_feed_delete(mpc_feed_t *f);
+void mpc_parser_feed(mpc_feed_t *f, const char *bytes, size_t length);
+void mpc_feed_end(mpc_feed_t *f);
+void mpc_feed_nesting(mpc_feed_t *f, char open, char close);
+int mpc_feed_next(mpc_feed_t *f, mpc_result_t *r);
+
+/*
+** Compiled Parsers
+*/
+
+struct mpc_program_t;
+typedef struct mpc_program_t mpc_program_t;
+
+mpc_program_t *mpc_compile(mpc_parser_t *p);
+void mpc_program_delete(mpc_program_t *prog);
+int mpc_parse_program(const char *filename, const char *string, size_t length, mpc_program_t *prog, mpc_result_t *r);
+void mpc_feed_program(mpc_feed_t *f, mpc_program_t *prog, int depth);
+
+/*
+** Sharing Parsers
+**
+** Once frozen, a grammar is never changed again and
+** may be parsed with from many threads at once. Any
+** mpc_define of a frozen parser deletes the new
+** definition and returns NULL, leaving it as it was.
+*/
+
+void mpc_freeze(mpc_parser_t *p);
+
 /*
 ** Building a Parser
 */
@@ -334,7 +383,8 @@ mpc_parser_t *mpca_and(int n, ...);
 enum {
   MPCA_LANG_DEFAULT              = 0,
   MPCA_LANG_PREDICTIVE           = 1,
-  MPCA_LANG_WHITESPACE_SENSITIVE = 2
+  MPCA_LANG_WHITESPACE_SENSITIVE = 2,
+  MPCA_LANG_PACKRAT              = 4
 };
 
 mpc_parser_t *mpca_grammar(int flags, const char *grammar, ...);
@@ -0,0 +1,196 @@
+/*
+** Stress test for sharing a frozen grammar between
+** threads. Each thread parses the same inputs over
+** and over, alternately with the grammar and with
+** the program compiled from it, and checks every
+** result against one parsed before any thread was
+** started. Build and run with
+**
+**   cc -I. mpc_stress.c mpc.c -lm -lpthread -o mpc_stress
+**   ./mpc_stress [threads] [parses per thread] [strict]
+**
+** It exits non zero if any result differed, or if
+** redefining a rule of the frozen grammar did not
+** fail and leave the grammar as it was.
+**
+** It then times the same number of parses split
+** over 1, 2, 4 and so on up to all the threads, and
+** prints the parses per second of each. It warns if
+** adding threads, while there are still processors
+** for them, did not raise the rate, and with strict
+** exits non zero for that too.
+*/
+
+#define _POSIX_C_SOURCE 200112L
+
+#include "mpc.h"
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+enum { STRESS_INPUTS = 8, STRESS_THREADS_MAX = 64 };
+
+static const char *inputs[STRESS_INPUTS] = {
+  "(+ 1 2)",
+  "(max 3 (- 9 1) 22)\n(x y)",
+  "(+ 1 (2",
+  "   (* 2 3) (1)  ",
+  "foobar_baz12 -123",
+  "(-) #",
+  "((((a))))\n\n  (b c\td)",
+  "(q ;"
+};
+
+static mpc_parser_t *Lispy;
+static mpc_program_t *Program;
+static mpc_ast_t *expect_ast[STRESS_INPUTS];
+static char *expect_err[STRESS_INPUTS];
+static int parses = 20000;
+
+/* Check a result against the expected one, deleting it */
+static int stress_check(int j, int ok, mpc_result_t *r) {
+
+  int same;
+  char *s;
+
+  if (ok) {
+    same = expect_ast[j] != NULL && mpc_ast_eq(expect_ast[j], r->output);
+    mpc_ast_delete(r->output);
+  } else {
+    s = mpc_err_string(r->error);
+    same = expect_err[j] != NULL && strcmp(expect_err[j], s) == 0;
+    free(s);
+    mpc_err_delete(r->error);
+  }
+
+  return same;
+}
+
+static void *stress_thread(void *arg) {
+
+  long id = (long)arg;
+  long bad = 0;
+  int k, j, ok;
+  mpc_result_t r;
+
+  for (k = 0; k < parses; k++) {
+    j = (int)((k + id) % STRESS_INPUTS);
+    if (k & 1) {
+      ok = mpc_parse_program("<stress>", inputs[j], strlen(inputs[j]), Program, &r);
+    } else {
+      ok = mpc_parse("<stress>", inputs[j], Lispy, &r);
+    }
+    if (!stress_check(j, ok, &r)) { bad++; }
+  }
+
+  return (void*)bad;
+}
+
+/* Run the stress threads, giving the mismatches and the seconds taken */
+static long stress_run(int n, double *secs) {
+
+  pthread_t threads[STRESS_THREADS_MAX];
+  struct timespec t0, t1;
+  long bad = 0;
+  void *b;
+  int i;
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (i = 0; i < n; i++) {
+    pthread_create(&threads[i], NULL, stress_thread, (void*)(long)i);
+  }
+  for (i = 0; i < n; i++) {
+    pthread_join(threads[i], &b);
+    bad += (long)b;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+
+  *secs = (double)(t1.tv_sec - t0.tv_sec) + (double)(t1.tv_nsec - t0.tv_nsec) / 1e9;
+  if (*secs <= 0) { *secs = 1e-9; }
+  return bad;
+}
+
+int main(int argc, char **argv) {
+
+  mpc_parser_t *Number = mpc_new("number");
+  mpc_parser_t *Symbol = mpc_new("symbol");
+  mpc_parser_t *Sexpr  = mpc_new("sexpr");
+  mpc_parser_t *Expr   = mpc_new("expr");
+  int n = argc > 1 ? atoi(argv[1]) : 8;
+  int strict = argc > 3 && strcmp(argv[3], "strict") == 0;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  long total, bad = 0;
+  int t, slow = 0;
+  double secs, rate, last = 0;
+  int j;
+  mpc_result_t r;
+
+  if (n < 1) { n = 1; }
+  if (n > STRESS_THREADS_MAX) { n = STRESS_THREADS_MAX; }
+  if (argc > 2) { parses = atoi(argv[2]); }
+
+  Lispy = mpc_new("lispy");
+  mpca_lang(MPCA_LANG_DEFAULT,
+    " number : /-?[0-9]+/ ;                             "
+    " symbol : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ;         "
+    " sexpr  : '(' <expr>* ')' ;                        "
+    " expr   : <number> | <symbol> | <sexpr> ;          "
+    " lispy  : /^/ <expr>* /$/ ;                        ",
+    Number, Symbol, Sexpr, Expr, Lispy, NULL);
+
+  mpc_freeze(Lispy);
+  Program = mpc_compile(Lispy);
+
+  for (j = 0; j < STRESS_INPUTS; j++) {
+    expect_ast[j] = NULL;
+    expect_err[j] = NULL;
+    if (mpc_parse("<stress>", inputs[j], Lispy, &r)) {
+      expect_ast[j] = r.output;
+    } else {
+      expect_err[j] = mpc_err_string(r.error);
+      mpc_err_delete(r.error);
+    }
+  }
+
+  bad += stress_run(n, &secs);
+  printf("%d threads, %d parses each, %ld mismatched\n", n, parses, bad);
+
+  /* Time the same total work over more and more threads */
+  total = (long)parses * n;
+  for (t = 1; ; t = t * 2 < n ? t * 2 : n) {
+    parses = (int)(total / t);
+    bad += stress_run(t, &secs);
+    rate = (double)parses * t / secs;
+    printf("%2d threads: %.0f parses/s\n", t, rate);
+    if (t > 1 && t <= cpus && rate <= last) {
+      printf("warning: %d threads parsed no faster than fewer\n", t);
+      slow++;
+    }
+    last = rate;
+    if (t == n) { break; }
+  }
+  if (cpus < n) {
+    printf("(%ld processors online, so %d threads cannot all run at once)\n", cpus, n);
+  }
+
+  /* Redefining a rule of the frozen grammar fails and changes nothing */
+  if (mpc_define(Expr, mpc_fail("redefined")) != NULL) {
+    printf("mpc_define of a frozen parser did not fail\n");
+    bad++;
+  }
+  for (j = 0; j < STRESS_INPUTS; j++) {
+    if (!stress_check(j, mpc_parse("<stress>", inputs[j], Lispy, &r), &r)) {
+      printf("frozen grammar changed parsing input %d\n", j);
+      bad++;
+    }
+  }
+
+  for (j = 0; j < STRESS_INPUTS; j++) {
+    if (expect_ast[j]) { mpc_ast_delete(expect_ast[j]); }
+    free(expect_err[j]);
+  }
+  mpc_program_delete(Program);
+  mpc_cleanup(5, Number, Symbol, Sexpr, Expr, Lispy);
+
+  return bad != 0 || (strict && slow != 0);
+}
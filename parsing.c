@@ -1,6 +1,12 @@
+/* For clock_gettime, which scripts are timed with */
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
 #include "mpc.h"
 
 /* If we are compiling on Windows compile these functions */
@@ -27,24 +33,245 @@ void add_history(char* unused) {}
 #include <editline/readline.h>
 #endif
 
+/*
+** Scripts are parsed and evaluated on several threads
+** only where there are pthreads. Elsewhere --jobs is
+** ignored and everything runs on the one thread.
+*/
+#ifndef _WIN32
+#define LISPVAL_THREADS
+#include <pthread.h>
+#define LISPVAL_LOCAL __thread
+#else
+#define LISPVAL_LOCAL
+#endif
+
 /* Create Enumeration of Possible lispval Types */
 enum { LISPVAL_NUM, LISPVAL_ERR, LISPVAL_SYM, LISPVAL_SEXPR };
 
 /* Declare New lisp value Struct */
 typedef struct lispval {
   int type;
-
-  long num;
-  char* err;
-  char* sym;
-
   int count;
-  struct lispval** cell;
+  int slots;
+
+  union {
+    long num;
+    char* err;
+    int sym;
+    struct lispval** cell;
+  };
 } lispval;
 
+/*
+** Numbers which fit are never allocated. They are
+** stored shifted up by one bit directly in the
+** lispval pointer, with the lowest bit set to mark
+** them apart from real (aligned) pointers.
+*/
+#define LISPVAL_FIXNUM_MIN (INTPTR_MIN / 2)
+#define LISPVAL_FIXNUM_MAX (INTPTR_MAX / 2)
+
+int lispval_is_fixnum(lispval* v) {
+  return ((uintptr_t)v & 1) != 0;
+}
+
+int lispval_type(lispval* v) {
+  return lispval_is_fixnum(v) ? LISPVAL_NUM : v->type;
+}
+
+long lispval_number(lispval* v) {
+  return lispval_is_fixnum(v) ? (long)((intptr_t)v >> 1) : v->num;
+}
+
+/* Region of memory that a whole evaluation allocates from */
+enum { LISPARENA_BLOCK = 64 * 1024, LISPARENA_ALIGN = 8 };
+
+typedef struct lispblock {
+  struct lispblock* next;
+  size_t size;
+  size_t used;
+  char data[];
+} lispblock;
+
+typedef struct lisparena {
+  lispblock* first;
+  lispblock* current;
+} lisparena;
+
+/* Arena the lispval constructors draw from, NULL means plain malloc */
+/* Each thread has its own, so threads reading in parallel never share one */
+LISPVAL_LOCAL lisparena* lispval_arena = NULL;
+
+lisparena* lisparena_new(void) {
+  lisparena* a = malloc(sizeof(lisparena));
+  a->first = NULL;
+  a->current = NULL;
+  return a;
+}
+
+void* lisparena_alloc(lisparena* a, size_t n) {
+  n = (n + LISPARENA_ALIGN - 1) & ~(size_t)(LISPARENA_ALIGN - 1);
+
+  /* Move on to the next block until one has enough room */
+  while (a->current && a->current->size - a->current->used < n) {
+    if (!a->current->next) { break; }
+    a->current = a->current->next;
+    a->current->used = 0;
+  }
+
+  /* Append a fresh block if we ran off the end */
+  if (!a->current || a->current->size - a->current->used < n) {
+    size_t size = n > LISPARENA_BLOCK ? n : LISPARENA_BLOCK;
+    lispblock* b = malloc(sizeof(lispblock) + size);
+    b->size = size;
+    b->used = 0;
+    b->next = NULL;
+    if (a->current) {
+      b->next = a->current->next;
+      a->current->next = b;
+    } else {
+      a->first = b;
+    }
+    a->current = b;
+  }
+
+  void* p = a->current->data + a->current->used;
+  a->current->used += n;
+  return p;
+}
+
+void* lisparena_realloc(lisparena* a, void* p, size_t old, size_t n) {
+  if (p == NULL) { return lisparena_alloc(a, n); }
+  if (n <= old) { return p; }
+
+  /* Grow in place if this was the last allocation in the block */
+  old = (old + LISPARENA_ALIGN - 1) & ~(size_t)(LISPARENA_ALIGN - 1);
+  lispblock* b = a->current;
+  if ((char*)p + old == b->data + b->used) {
+    size_t extra = ((n + LISPARENA_ALIGN - 1) & ~(size_t)(LISPARENA_ALIGN - 1)) - old;
+    if (b->size - b->used >= extra) {
+      b->used += extra;
+      return p;
+    }
+  }
+
+  void* q = lisparena_alloc(a, n);
+  memcpy(q, p, old);
+  return q;
+}
+
+/* Release everything allocated since the last reset, keeping the blocks */
+void lisparena_reset(lisparena* a) {
+  a->current = a->first;
+  if (a->current) { a->current->used = 0; }
+}
+
+void lisparena_del(lisparena* a) {
+  lispblock* b = a->first;
+  while (b) {
+    lispblock* next = b->next;
+    free(b);
+    b = next;
+  }
+  free(a);
+}
+
+void* lispval_alloc(size_t n) {
+  return lispval_arena ? lisparena_alloc(lispval_arena, n) : malloc(n);
+}
+
+void* lispval_realloc(void* p, size_t old, size_t n) {
+  return lispval_arena ? lisparena_realloc(lispval_arena, p, old, n) : realloc(p, n);
+}
+
+void lispval_free(void* p) {
+  if (!lispval_arena) { free(p); }
+}
+
+/*
+** Symbols are interned into a table giving each
+** name a small integer id. The id indexes the
+** builtin operator directly, so dispatch costs
+** the same however many builtins there are.
+*/
+
+/* Builtin operator folding the next argument into the accumulator */
+typedef char* (*lispop)(long* x, long y);
+
+typedef struct {
+  char* name;
+  lispop op;
+} lispsym;
+
+lispsym* lispsyms = NULL;
+int lispsyms_count = 0;
+int lispsyms_slots = 0;
+
+/* Open addressed hash of symbol ids plus one, zero for empty */
+int* lispsym_table = NULL;
+int lispsym_table_slots = 0;
+
+unsigned long lispsym_hash(const char* s, size_t len) {
+  unsigned long h = 2166136261ul;
+  for (size_t i = 0; i < len; i++) {
+    h = (h ^ (unsigned char)s[i]) * 16777619ul;
+  }
+  return h;
+}
+
+void lispsym_table_insert(int id) {
+  const char* name = lispsyms[id].name;
+  unsigned long j = lispsym_hash(name, strlen(name));
+  while (lispsym_table[j & (lispsym_table_slots-1)]) { j++; }
+  lispsym_table[j & (lispsym_table_slots-1)] = id + 1;
+}
+
+/* Find the id of the symbol spelt by s[0..len), adding it if new */
+int lispsym_intern_len(const char* s, size_t len) {
+
+  if (lispsym_table_slots) {
+    unsigned long j = lispsym_hash(s, len);
+    int id;
+    while ((id = lispsym_table[j & (lispsym_table_slots-1)])) {
+      const char* name = lispsyms[id-1].name;
+      if (strncmp(name, s, len) == 0 && name[len] == '\0') { return id-1; }
+      j++;
+    }
+  }
+
+  /* Keep the table at most half full */
+  if ((lispsyms_count+1) * 2 > lispsym_table_slots) {
+    free(lispsym_table);
+    lispsym_table_slots = lispsym_table_slots ? lispsym_table_slots * 2 : 64;
+    lispsym_table = calloc(lispsym_table_slots, sizeof(int));
+    for (int i = 0; i < lispsyms_count; i++) { lispsym_table_insert(i); }
+  }
+
+  if (lispsyms_count == lispsyms_slots) {
+    lispsyms_slots = lispsyms_slots ? lispsyms_slots * 2 : 32;
+    lispsyms = realloc(lispsyms, sizeof(lispsym) * lispsyms_slots);
+  }
+
+  int id = lispsyms_count++;
+  lispsyms[id].name = malloc(len + 1);
+  memcpy(lispsyms[id].name, s, len);
+  lispsyms[id].name[len] = '\0';
+  lispsyms[id].op = NULL;
+  lispsym_table_insert(id);
+  return id;
+}
+
+int lispsym_intern(const char* s) {
+  return lispsym_intern_len(s, strlen(s));
+}
+
 /* Construct a pointer to a new Number lispval */
 lispval* lispval_num(long x) {
-  lispval* v = malloc(sizeof(lispval));
+  if (x >= LISPVAL_FIXNUM_MIN && x <= LISPVAL_FIXNUM_MAX) {
+    return (lispval*)(((uintptr_t)(intptr_t)x << 1) | 1);
+  }
+  lispval* v = lispval_alloc(sizeof(lispval));
   v->type = LISPVAL_NUM;
   v->num = x;
   return v;
@@ -52,140 +279,521 @@ lispval* lispval_num(long x) {
 
 /* Construct a pointer to a new Error lispval */
 lispval* lispval_err(char* m) {
-  lispval* v = malloc(sizeof(lispval));
+  lispval* v = lispval_alloc(sizeof(lispval));
   v->type = LISPVAL_ERR;
-  v->err = malloc(strlen(m) + 1);
+  v->err = lispval_alloc(strlen(m) + 1);
   strcpy(v->err, m);
   return v;
 }
 
 /* Construct a pointer to a new Symbol lispval */
 lispval* lispval_sym(char* s) {
-  lispval* v = malloc(sizeof(lispval));
+  lispval* v = lispval_alloc(sizeof(lispval));
+  v->type = LISPVAL_SYM;
+  v->sym = lispsym_intern(s);
+  return v;
+}
+
+/* Construct a Symbol lispval from the first len characters of s */
+lispval* lispval_sym_len(const char* s, size_t len) {
+  lispval* v = lispval_alloc(sizeof(lispval));
   v->type = LISPVAL_SYM;
-  v->sym = malloc(strlen(s) + 1);
-  strcpy(v->sym, s);
+  v->sym = lispsym_intern_len(s, len);
   return v;
 }
 
 /* Construct a pointer to a new empty Sexpr lispval */
 lispval* lispval_sexpr(void) {
-  lispval* v = malloc(sizeof(lispval));
+  lispval* v = lispval_alloc(sizeof(lispval));
   v->type = LISPVAL_SEXPR;
   v->count = 0;
+  v->slots = 0;
   v->cell = NULL;
   return v;
 }
 
+/* Construct an empty Sexpr with room for n children up front */
+lispval* lispval_sexpr_sized(int n) {
+  lispval* v = lispval_sexpr();
+  if (n > 0) {
+    v->slots = n;
+    v->cell = lispval_alloc(sizeof(lispval*) * n);
+  }
+  return v;
+}
+
+/*
+** Walks over nested S-expressions keep their own
+** stack instead of recursing, so how deep input
+** may nest is set by lispval_max_depth rather than
+** by the C stack. Small stacks stay in the frame
+** of the caller and only deep ones reach malloc.
+*/
+
+enum { LISPSTACK_LOCAL = 64 };
+
+typedef struct {
+  int count;
+  int slots;
+  void** items;
+  void* local[LISPSTACK_LOCAL];
+} lispstack;
+
+/* Deepest nesting the reader, evaluator and compiler accept */
+int lispval_max_depth = 10000;
+
+void lispstack_init(lispstack* s) {
+  s->count = 0;
+  s->slots = LISPSTACK_LOCAL;
+  s->items = s->local;
+}
+
+void lispstack_push(lispstack* s, void* x) {
+  if (s->count == s->slots) {
+    s->slots *= 2;
+    if (s->items == s->local) {
+      s->items = malloc(sizeof(void*) * s->slots);
+      memcpy(s->items, s->local, sizeof(s->local));
+    } else {
+      s->items = realloc(s->items, sizeof(void*) * s->slots);
+    }
+  }
+  s->items[s->count++] = x;
+}
+
+void* lispstack_pop(lispstack* s) {
+  return s->items[--s->count];
+}
+
+void lispstack_free(lispstack* s) {
+  if (s->items != s->local) { free(s->items); }
+}
+
 void lispval_del(lispval* v) {
 
-  switch (v->type) {
-    /* Do nothing special for number type */
-    case LISPVAL_NUM: break;
+  /* Arena memory is only ever released as a whole */
+  if (lispval_arena) { return; }
+
+  /* Children still to be deleted */
+  lispstack pending;
+  lispstack_init(&pending);
+
+  while (1) {
+    /* Immediate numbers own no memory */
+    if (!lispval_is_fixnum(v)) {
+      switch (v->type) {
+        /* Do nothing special for number type */
+        case LISPVAL_NUM: break;
+
+        /* For Err or Sym free the string data */
+        case LISPVAL_ERR: lispval_free(v->err); break;
+        /* Symbol names belong to the intern table */
+        case LISPVAL_SYM: break;
+
+        /* If Sexpr then delete all elements inside */
+        case LISPVAL_SEXPR:
+          for (int i = 0; i < v->count; i++) {
+            lispstack_push(&pending, v->cell[i]);
+          }
+          /* Also free the memory allocated to contain the pointers */
+          lispval_free(v->cell);
+        break;
+      }
 
-    /* For Err or Sym free the string data */
-    case LISPVAL_ERR: free(v->err); break;
-    case LISPVAL_SYM: free(v->sym); break;
+      /* Free the memory allocated for the "lispval" struct itself */
+      lispval_free(v);
+    }
+
+    if (pending.count == 0) { break; }
+    v = lispstack_pop(&pending);
+  }
 
-    /* If Sexpr then delete all elements inside */
+  lispstack_free(&pending);
+}
+
+lispval* lispval_add(lispval* v, lispval* x);
+
+lispval* lispval_copy(lispval* v) {
+  if (lispval_is_fixnum(v)) { return v; }
+  lispval* x = NULL;
+  switch (v->type) {
+    case LISPVAL_NUM: x = lispval_num(v->num); break;
+    case LISPVAL_ERR: x = lispval_err(v->err); break;
+    case LISPVAL_SYM:
+      x = lispval_alloc(sizeof(lispval));
+      x->type = LISPVAL_SYM;
+      x->sym = v->sym;
+    break;
     case LISPVAL_SEXPR:
+      x = lispval_sexpr_sized(v->count);
       for (int i = 0; i < v->count; i++) {
-        lispval_del(v->cell[i]);
+        lispval_add(x, lispval_copy(v->cell[i]));
       }
-      /* Also free the memory allocated to contain the pointers */
-      free(v->cell);
     break;
   }
+  return x;
+}
+
 
-  /* Free the memory allocated for the "lispval" struct itself */
-  free(v);
+lispval* lispval_add(lispval* v, lispval* x) {
+  /* Grow geometrically so n additions cost O(log n) reallocations */
+  if (v->count == v->slots) {
+    int slots = v->slots ? v->slots * 2 : 4;
+    v->cell = lispval_realloc(v->cell,
+      sizeof(lispval*) * v->slots, sizeof(lispval*) * slots);
+    v->slots = slots;
+  }
+  v->cell[v->count++] = x;
+  return v;
 }
 
-lispval* lispval_read_num(mpc_ast_t* t) {
+/*
+** The reader builds lispvals directly as mpc
+** matches the input, through these apply and
+** fold callbacks, without an intermediate AST.
+*/
+
+mpc_val_t* lispval_read_num(mpc_val_t* x) {
   errno = 0;
-  long x = strtol(t->contents, NULL, 10);
-  return errno != ERANGE ?
-    lispval_num(x) : lispval_err("invalid number");
+  long n = strtol(x, NULL, 10);
+  lispval* v = errno != ERANGE ?
+    lispval_num(n) : lispval_err("invalid number");
+  free(x);
+  return v;
 }
 
-lispval* lispval_add(lispval* v, lispval* x) {
-  v->count++;
-  v->cell = realloc(v->cell, sizeof(lispval*) * v->count);
-  v->cell[v->count-1] = x;
+mpc_val_t* lispval_read_sym(mpc_val_t* x) {
+  lispval* v = lispval_sym(x);
+  free(x);
   return v;
 }
 
-lispval* lispval_read(mpc_ast_t* t) {
+mpc_val_t* lispval_read_list(int n, mpc_val_t** xs) {
+  lispval* v = lispval_sexpr_sized(n);
+  for (int i = 0; i < n; i++) { lispval_add(v, xs[i]); }
+  return v;
+}
+
+/*
+** The default reader is hand written. A table
+** classifies every byte, and the tokenizer hands
+** out slices of the input rather than copies. On
+** any syntax error the input is parsed again with
+** the mpc grammar, which stays the reference and
+** reports the error. Passing --mpc uses the mpc
+** grammar for everything.
+*/
+
+enum {
+  LISPCHAR_OTHER, LISPCHAR_SPACE, LISPCHAR_DIGIT, LISPCHAR_MINUS,
+  LISPCHAR_OP, LISPCHAR_WORD, LISPCHAR_OPEN, LISPCHAR_CLOSE
+};
+
+static const unsigned char lispchars[256] = {
+  [' ']  = LISPCHAR_SPACE, ['\f'] = LISPCHAR_SPACE, ['\n'] = LISPCHAR_SPACE,
+  ['\r'] = LISPCHAR_SPACE, ['\t'] = LISPCHAR_SPACE, ['\v'] = LISPCHAR_SPACE,
+  ['0'] = LISPCHAR_DIGIT, ['1'] = LISPCHAR_DIGIT, ['2'] = LISPCHAR_DIGIT,
+  ['3'] = LISPCHAR_DIGIT, ['4'] = LISPCHAR_DIGIT, ['5'] = LISPCHAR_DIGIT,
+  ['6'] = LISPCHAR_DIGIT, ['7'] = LISPCHAR_DIGIT, ['8'] = LISPCHAR_DIGIT,
+  ['9'] = LISPCHAR_DIGIT,
+  ['-'] = LISPCHAR_MINUS,
+  ['+'] = LISPCHAR_OP, ['*'] = LISPCHAR_OP, ['/'] = LISPCHAR_OP,
+  ['%'] = LISPCHAR_OP, ['^'] = LISPCHAR_OP,
+  ['m'] = LISPCHAR_WORD,
+  ['('] = LISPCHAR_OPEN, [')'] = LISPCHAR_CLOSE
+};
+
+enum { LISPTOK_END, LISPTOK_NUM, LISPTOK_SYM, LISPTOK_OPEN, LISPTOK_CLOSE, LISPTOK_ERR };
+
+typedef struct {
+  int type;
+  const char* start;
+  size_t len;
+} lisptok;
 
-  /* If Symbol or Number return conversion to that type */
-  if (strstr(t->tag, "number")) { return lispval_read_num(t); }
-  if (strstr(t->tag, "symbol")) { return lispval_sym(t->contents); }
+typedef struct {
+  const char* pos;
+  const char* end;
+} lisplexer;
 
-  /* If root (>) or sexpr then create empty list */
-  lispval* x = NULL;
-  if (strcmp(t->tag, ">") == 0) { x = lispval_sexpr(); }
-  if (strstr(t->tag, "sexpr"))  { x = lispval_sexpr(); }
+lisptok lisplexer_next(lisplexer* l) {
+  const char* p = l->pos;
+  const char* end = l->end;
+
+  while (p < end && lispchars[(unsigned char)*p] == LISPCHAR_SPACE) { p++; }
+
+  lisptok t = { LISPTOK_END, p, 0 };
+  if (p == end) { l->pos = p; return t; }
+
+  switch (lispchars[(unsigned char)*p]) {
+
+    case LISPCHAR_MINUS:
+      /* A minus sign directly before a digit starts a number */
+      if (p+1 == end || lispchars[(unsigned char)p[1]] != LISPCHAR_DIGIT) {
+        t.type = LISPTOK_SYM; p++; break;
+      }
+      p++;
+      /* fallthrough */
+    case LISPCHAR_DIGIT:
+      while (p < end && lispchars[(unsigned char)*p] == LISPCHAR_DIGIT) { p++; }
+      t.type = LISPTOK_NUM;
+    break;
+
+    case LISPCHAR_OP:    t.type = LISPTOK_SYM;   p++; break;
+    case LISPCHAR_OPEN:  t.type = LISPTOK_OPEN;  p++; break;
+    case LISPCHAR_CLOSE: t.type = LISPTOK_CLOSE; p++; break;
 
-  /* Fill this list with any valid expression contained within */
-  for (int i = 0; i < t->children_num; i++) {
-    if (strcmp(t->children[i]->contents, "(") == 0) { continue; }
-    if (strcmp(t->children[i]->contents, ")") == 0) { continue; }
-    if (strcmp(t->children[i]->contents, "}") == 0) { continue; }
-    if (strcmp(t->children[i]->contents, "{") == 0) { continue; }
-    if (strcmp(t->children[i]->tag,  "regex") == 0) { continue; }
-    x = lispval_add(x, lispval_read(t->children[i]));
+    case LISPCHAR_WORD:
+      if (end - p >= 3 && (memcmp(p, "min", 3) == 0 || memcmp(p, "max", 3) == 0)) {
+        t.type = LISPTOK_SYM; p += 3; break;
+      }
+      t.type = LISPTOK_ERR;
+    break;
+
+    default: t.type = LISPTOK_ERR; break;
   }
 
-  return x;
+  t.len = p - t.start;
+  l->pos = p;
+  return t;
 }
 
-void lispval_print(lispval* v);
+/* Convert a number token, giving the same result strtol would */
+lispval* lispval_read_num_len(const char* s, size_t len) {
+  int neg = s[0] == '-';
+  long x = 0;
 
-void lispval_expr_print(lispval* v, char open, char close) {
-  putchar(open);
-  for (int i = 0; i < v->count; i++) {
+  /* Accumulate negatively so LONG_MIN is representable */
+  for (size_t i = neg; i < len; i++) {
+    int d = s[i] - '0';
+    if (x < (LONG_MIN + d) / 10) { return lispval_err("invalid number"); }
+    x = x * 10 - d;
+  }
 
-    /* Print Value contained within */
-    lispval_print(v->cell[i]);
+  if (!neg) {
+    if (x == LONG_MIN) { return lispval_err("invalid number"); }
+    x = -x;
+  }
+  return lispval_num(x);
+}
 
-    /* Don't print trailing space if last element */
-    if (i != (v->count-1)) {
-      putchar(' ');
+/* Skip past the close of the n S-expressions open at l, zero if input ends first */
+int lisplexer_skip(lisplexer* l, int n) {
+  while (n > 0) {
+    lisptok t = lisplexer_next(l);
+    if (t.type == LISPTOK_OPEN) { n++; }
+    else if (t.type == LISPTOK_CLOSE) { n--; }
+    else if (t.type == LISPTOK_END || t.type == LISPTOK_ERR) { return 0; }
+  }
+  return 1;
+}
+
+/*
+** Read the expression starting with token t, which is
+** nested depth deep already, NULL on a syntax error.
+** Forms nesting past lispval_max_depth read as an error.
+*/
+lispval* lispval_read_tok(lisplexer* l, lisptok t, int depth) {
+  switch (t.type) {
+    case LISPTOK_NUM: return lispval_read_num_len(t.start, t.len);
+    case LISPTOK_SYM: return lispval_sym_len(t.start, t.len);
+    case LISPTOK_OPEN: break;
+    default: return NULL;
+  }
+
+  if (depth >= lispval_max_depth) {
+    if (!lisplexer_skip(l, 1)) { return NULL; }
+    return lispval_err("Expression nested too deeply!");
+  }
+
+  /* S-expressions still open around x, outermost first */
+  lispstack open;
+  lispstack_init(&open);
+  lispval* x = lispval_sexpr();
+
+  while (1) {
+    t = lisplexer_next(l);
+    lispval* y;
+    switch (t.type) {
+      case LISPTOK_NUM: y = lispval_read_num_len(t.start, t.len); break;
+      case LISPTOK_SYM: y = lispval_sym_len(t.start, t.len); break;
+
+      case LISPTOK_OPEN:
+        if (depth + open.count + 2 <= lispval_max_depth) {
+          lispstack_push(&open, x);
+          x = lispval_sexpr();
+          continue;
+        }
+        /* Too deep, so skip to the end of the form and read an error */
+        y = lisplexer_skip(l, open.count + 2) ?
+          lispval_err("Expression nested too deeply!") : NULL;
+        while (open.count > 0) { lispval_del(lispstack_pop(&open)); }
+        lispval_del(x);
+        lispstack_free(&open);
+        return y;
+
+      case LISPTOK_CLOSE:
+        if (open.count == 0) {
+          lispstack_free(&open);
+          return x;
+        }
+        y = x;
+        x = lispstack_pop(&open);
+      break;
+
+      default:
+        /* Each open S-expression holds only what closed inside it */
+        while (open.count > 0) { lispval_del(lispstack_pop(&open)); }
+        lispval_del(x);
+        lispstack_free(&open);
+        return NULL;
     }
+    lispval_add(x, y);
   }
-  putchar(close);
 }
 
-void lispval_print(lispval* v) {
-  switch (v->type) {
-    case LISPVAL_NUM:   printf("%li", v->num); break;
-    case LISPVAL_ERR:   printf("Error: %s", v->err); break;
-    case LISPVAL_SYM:   printf("%s", v->sym); break;
-    case LISPVAL_SEXPR: lispval_expr_print(v, '(', ')'); break;
+/* Report where the reader gave up on buf, the way mpc reports errors */
+void lisplexer_error(const char* name, const char* buf, const char* pos) {
+  long row = 1, col = 1;
+  for (const char* p = buf; p < pos; p++) {
+    if (*p == '\n') { row++; col = 1; }
+    else { col++; }
   }
+  fprintf(stderr, "%s:%ld:%ld: error: unexpected input\n", name, row, col);
 }
 
-void lispval_println(lispval* v) { lispval_print(v); putchar('\n'); }
+/* Read every expression in input into one S-expression, NULL on error */
+lispval* lispval_read_string(const char* input, size_t len) {
+  lisplexer l = { input, input + len };
+  lispval* x = lispval_sexpr();
+  lisptok t;
+  while ((t = lisplexer_next(&l)).type != LISPTOK_END) {
+    lispval* y = lispval_read_tok(&l, t, 1);
+    if (y == NULL) { lispval_del(x); return NULL; }
+    lispval_add(x, y);
+  }
+  return x;
+}
 
+/*
+** Printing goes through a lispout buffer rather than
+** stdio, which it hands to its FILE in large writes.
+** Only flushing it pushes the FILE out too, which is
+** left to a prompt, an error message or exit.
+*/
 
-lispval* lispval_pop(lispval* v, int i) {
-  /* Find the item at "i" */
-  lispval* x = v->cell[i];
+typedef struct {
+  char* data;
+  size_t len;
+  size_t size;
+  FILE* file;
+} lispout;
 
-  /* Shift memory after the item at "i" over the top */
-  memmove(&v->cell[i], &v->cell[i+1],
-    sizeof(lispval*) * (v->count-i-1));
+enum { LISPOUT_SIZE = 64 * 1024 };
 
-  /* Decrease the count of items in the list */
-  v->count--;
+lispout lispout_stdout;
 
-  /* Reallocate the memory used */
-  v->cell = realloc(v->cell, sizeof(lispval*) * v->count);
-  return x;
+lispout lispout_file(FILE* f) {
+  lispout o = { malloc(LISPOUT_SIZE), 0, LISPOUT_SIZE, f };
+  return o;
+}
+
+/* Hand what is buffered to the FILE */
+void lispout_drain(lispout* o) {
+  fwrite(o->data, 1, o->len, o->file);
+  o->len = 0;
+}
+
+/* Write out everything printed so far */
+void lispout_flush(lispout* o) {
+  lispout_drain(o);
+  fflush(o->file);
+}
+
+void lispout_write(lispout* o, const char* s, size_t n) {
+  if (o->len + n > o->size) {
+    lispout_drain(o);
+    if (n > o->size) { fwrite(s, 1, n, o->file); return; }
+  }
+  memcpy(o->data + o->len, s, n);
+  o->len += n;
+}
+
+void lispout_putc(lispout* o, char c) {
+  if (o->len < o->size) { o->data[o->len++] = c; return; }
+  lispout_write(o, &c, 1);
+}
+
+static const char lispout_digits[201] =
+  "0001020304050607080910111213141516171819"
+  "2021222324252627282930313233343536373839"
+  "4041424344454647484950515253545556575859"
+  "6061626364656667686970717273747576777879"
+  "8081828384858687888990919293949596979899";
+
+/* Write x in decimal, two digits at a time from the right */
+void lispout_long(lispout* o, long x) {
+  char tmp[24];
+  char* p = tmp + sizeof(tmp);
+  unsigned long u = x < 0 ? 0UL - (unsigned long)x : (unsigned long)x;
+  while (u >= 100) {
+    const char* d = lispout_digits + (u % 100) * 2;
+    u /= 100;
+    *--p = d[1];
+    *--p = d[0];
+  }
+  if (u >= 10) {
+    *--p = lispout_digits[u * 2 + 1];
+    *--p = lispout_digits[u * 2];
+  } else {
+    *--p = '0' + u;
+  }
+  if (x < 0) { *--p = '-'; }
+  lispout_write(o, p, tmp + sizeof(tmp) - p);
 }
 
+void lispval_write(lispout* o, lispval* v);
+
+void lispval_expr_write(lispout* o, lispval* v, char open, char close) {
+  lispout_putc(o, open);
+  for (int i = 0; i < v->count; i++) {
+
+    /* Print Value contained within */
+    lispval_write(o, v->cell[i]);
+
+    /* Don't print trailing space if last element */
+    if (i != (v->count-1)) {
+      lispout_putc(o, ' ');
+    }
+  }
+  lispout_putc(o, close);
+}
+
+void lispval_write(lispout* o, lispval* v) {
+  switch (lispval_type(v)) {
+    case LISPVAL_NUM:
+      lispout_long(o, lispval_number(v));
+    break;
+    case LISPVAL_ERR:
+      lispout_write(o, "Error: ", 7);
+      lispout_write(o, v->err, strlen(v->err));
+    break;
+    case LISPVAL_SYM: {
+      char* name = lispsyms[v->sym].name;
+      lispout_write(o, name, strlen(name));
+    } break;
+    case LISPVAL_SEXPR: lispval_expr_write(o, v, '(', ')'); break;
+  }
+}
+
+void lispval_print(lispval* v) { lispval_write(&lispout_stdout, v); }
+void lispval_println(lispval* v) { lispval_print(v); lispout_putc(&lispout_stdout, '\n'); }
+
+
 lispval* lispval_take(lispval* v, int i) {
-  lispval* x = lispval_pop(v, i);
+  /* Swap the item at "i" out for the last one rather than shifting */
+  lispval* x = v->cell[i];
+  v->cell[i] = v->cell[--v->count];
   lispval_del(v);
   return x;
 }
@@ -198,126 +806,1142 @@ long maxl(long a, long b) {
   return a > b ? a : b;
 }
 
-lispval* builtin_op(lispval* a, char* op) {
+char* builtin_add(long* x, long y) { *x += y; return NULL; }
+char* builtin_sub(long* x, long y) { *x -= y; return NULL; }
+char* builtin_mul(long* x, long y) { *x *= y; return NULL; }
+char* builtin_mod(long* x, long y) { *x %= y; return NULL; }
+char* builtin_pow(long* x, long y) { *x = powl(*x, y); return NULL; }
+char* builtin_min(long* x, long y) { *x = minl(*x, y); return NULL; }
+char* builtin_max(long* x, long y) { *x = maxl(*x, y); return NULL; }
+
+char* builtin_div(long* x, long y) {
+  if (y == 0) { return "Division By Zero!"; }
+  *x /= y;
+  return NULL;
+}
+
+/* Ids of the builtins, in the order lispsym_builtins interns them */
+enum {
+  LISPSYM_ADD, LISPSYM_SUB, LISPSYM_MUL, LISPSYM_DIV,
+  LISPSYM_MOD, LISPSYM_POW, LISPSYM_MIN, LISPSYM_MAX
+};
+
+void lispsym_builtin(char* name, lispop op) {
+  int id = lispsym_intern(name);
+  lispsyms[id].op = op;
+}
+
+void lispsym_builtins(void) {
+  lispsym_builtin("+",   builtin_add);
+  lispsym_builtin("-",   builtin_sub);
+  lispsym_builtin("*",   builtin_mul);
+  lispsym_builtin("/",   builtin_div);
+  lispsym_builtin("%",   builtin_mod);
+  lispsym_builtin("^",   builtin_pow);
+  lispsym_builtin("min", builtin_min);
+  lispsym_builtin("max", builtin_max);
+}
+
+/* Fold the n arguments in xs with builtin sym, leaving them in place */
+lispval* builtin_op(lispval** xs, int n, int sym) {
+
+  /* Look the operator up once for the whole argument list */
+  lispop op = lispsyms[sym].op;
+  if (op == NULL) { return lispval_err("Unknown Function!"); }
 
   /* Ensure all arguments are numbers */
-  for (int i = 0; i < a->count; i++) {
-    if (a->cell[i]->type != LISPVAL_NUM) {
-      lispval_del(a);
+  for (int i = 0; i < n; i++) {
+    if (lispval_type(xs[i]) != LISPVAL_NUM) {
       return lispval_err("Cannot operate on non-number!");
     }
   }
 
-  /* Pop the first element */
-  lispval* x = lispval_pop(a, 0);
+  long x = lispval_number(xs[0]);
 
   /* If no arguments and sub then perform unary negation */
-  if ((strcmp(op, "-") == 0) && a->count == 0) {
-    x->num = -x->num;
+  if (sym == LISPSYM_SUB && n == 1) {
+    x = -x;
+  }
+
+  /* Walk the remaining arguments without moving them */
+  for (int i = 1; i < n; i++) {
+    char* err = op(&x, lispval_number(xs[i]));
+    if (err) { return lispval_err(err); }
+  }
+
+  return lispval_num(x);
+}
+
+/* Apply an S-expression whose children have all been evaluated */
+lispval* lispval_eval_sexpr(lispval* v) {
+
+  /* Error Checking */
+  for (int i = 0; i < v->count; i++) {
+    if (lispval_type(v->cell[i]) == LISPVAL_ERR) { return lispval_take(v, i); }
+  }
+
+  /* Empty Expression */
+  if (v->count == 0) { return v; }
+
+  /* Single Expression */
+  if (v->count == 1) { return lispval_take(v, 0); }
+
+  /* Ensure First Element is Symbol */
+  lispval* f = v->cell[0];
+  if (lispval_type(f) != LISPVAL_SYM) {
+    lispval_del(v);
+    return lispval_err("S-expression Does not start with symbol!");
+  }
+
+  /* Call builtin with operator on the arguments after it */
+  lispval* result = builtin_op(v->cell + 1, v->count - 1, f->sym);
+  lispval_del(v);
+  return result;
+}
+
+/* Evaluate v, itself nested depth deep, on this thread alone */
+lispval* lispval_eval_from(lispval* v, int depth) {
+  /* All other lval types remain the same */
+  if (lispval_type(v) != LISPVAL_SEXPR) { return v; }
+
+  /*
+  ** Evaluate the children of an S-expression before
+  ** applying it. The stack holds every S-expression
+  ** waiting on a child, each followed by the index of
+  ** that child.
+  */
+  lispstack frames;
+  lispstack_init(&frames);
+  int i = 0;
+
+  while (1) {
+
+    /* Descend into the next child that is an S-expression */
+    while (i < v->count && lispval_type(v->cell[i]) != LISPVAL_SEXPR) { i++; }
+    if (i < v->count) {
+      if (depth + frames.count / 2 + 1 < lispval_max_depth) {
+        lispstack_push(&frames, v);
+        lispstack_push(&frames, (void*)(intptr_t)i);
+        v = v->cell[i];
+        i = 0;
+      } else {
+        lispval_del(v->cell[i]);
+        v->cell[i] = lispval_err("Expression nested too deeply!");
+      }
+      continue;
+    }
+
+    /* Every child is done, so apply v and hand it to its parent */
+    lispval* x = lispval_eval_sexpr(v);
+    if (frames.count == 0) {
+      lispstack_free(&frames);
+      return x;
+    }
+    i = (intptr_t)lispstack_pop(&frames);
+    v = lispstack_pop(&frames);
+    v->cell[i++] = x;
   }
+}
+
+/*
+** With --jobs N evaluation is spread over N threads
+** as well. Builtins have no side effects, so the
+** children of an S-expression can be evaluated in
+** any order and in parallel without it showing. A
+** child of at least lispval_fork_size values becomes
+** a task, pushed onto the bottom of the deque of the
+** thread that found it, which works back up from
+** there, while idle threads steal from the tops,
+** where the oldest and biggest tasks are. A thread
+** waiting for a task to finish runs other tasks in
+** the meantime. Smaller children are evaluated in
+** place, and forking stops after a fixed number of
+** levels, which bounds how often subtrees are sized.
+*/
+int lispval_fork_size = 4096;
+
+enum { LISPVAL_FORK_LEVELS = 32 };
+
+#ifdef LISPVAL_THREADS
 
-  /* While there are still elements remaining */
-  while (a->count > 0) {
+typedef struct {
+  /* Child to evaluate, replaced by its value */
+  lispval** slot;
+  int depth;
+  int level;
+  int done;
+} lisptask;
 
-    /* Pop the next element */
-    lispval* y = lispval_pop(a, 0);
+typedef struct {
+  lisptask** tasks;
+  int top;
+  int bottom;
+  int slots;
+} lispdeque;
 
-    if (strcmp(op, "+") == 0) { x->num += y->num; }
-    if (strcmp(op, "-") == 0) { x->num -= y->num; }
-    if (strcmp(op, "*") == 0) { x->num *= y->num; }
-    if (strcmp(op, "/") == 0) {
-      if (y->num == 0) {
-        lispval_del(x); lispval_del(y);
-        x = lispval_err("Division By Zero!"); break;
+typedef struct {
+  int count;
+  lispdeque* deques;
+  /* Arenas of the threads started, the first is the caller's */
+  lisparena** arenas;
+  pthread_t* threads;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  int quit;
+} lisppool;
+
+/* Pool evaluating big expressions, NULL to evaluate on one thread */
+lisppool* lispval_pool = NULL;
+
+/* Index of the deque of this thread, the thread starting the pool has the first */
+LISPVAL_LOCAL int lisppool_self = 0;
+
+/* Number of values in v, counting no further than limit */
+int lispval_size(lispval* v, int limit) {
+  lispstack pending;
+  lispstack_init(&pending);
+  int size = 0;
+
+  /* Values still pending count at least one each */
+  while (1) {
+    size++;
+    if (lispval_type(v) == LISPVAL_SEXPR) {
+      for (int i = 0; i < v->count && size + pending.count < limit; i++) {
+        lispstack_push(&pending, v->cell[i]);
       }
-      x->num /= y->num;
     }
-    if (strcmp(op, "%") == 0) { x->num %= y->num; }
-    if (strcmp(op, "^") == 0) { x->num = powl(x->num, y->num); }
-    if (strcmp(op, "min") == 0) { x->num = minl(x->num, y->num); }
-    if (strcmp(op, "max") == 0) { x->num = maxl(x->num, y->num); }
+    if (pending.count == 0 || size + pending.count >= limit) { break; }
+    v = lispstack_pop(&pending);
+  }
+
+  size += pending.count;
+  lispstack_free(&pending);
+  return size;
+}
 
-    lispval_del(y);
+/* The deque functions expect the pool lock to be held */
+void lispdeque_push(lispdeque* d, lisptask* t) {
+  if (d->bottom == d->slots) {
+    if (d->top > 0) {
+      memmove(d->tasks, d->tasks + d->top, sizeof(lisptask*) * (d->bottom - d->top));
+      d->bottom -= d->top;
+      d->top = 0;
+    } else {
+      d->slots = d->slots ? d->slots * 2 : 16;
+      d->tasks = realloc(d->tasks, sizeof(lisptask*) * d->slots);
+    }
   }
+  d->tasks[d->bottom++] = t;
+}
 
-  lispval_del(a); return x;
+lisptask* lispdeque_pop(lispdeque* d) {
+  return d->bottom > d->top ? d->tasks[--d->bottom] : NULL;
 }
 
-lispval* lispval_eval(lispval* v);
+lisptask* lispdeque_steal(lispdeque* d) {
+  return d->bottom > d->top ? d->tasks[d->top++] : NULL;
+}
 
-lispval* lispval_eval_sexpr(lispval* v) {
+/* Newest task of this thread, or else the oldest of another */
+lisptask* lisppool_take(lisppool* p) {
+  lisptask* t = lispdeque_pop(&p->deques[lisppool_self]);
+  for (int i = 1; t == NULL && i < p->count; i++) {
+    t = lispdeque_steal(&p->deques[(lisppool_self + i) % p->count]);
+  }
+  return t;
+}
+
+lispval* lispval_eval_fork(lispval* v, int depth, int level);
+int lispthread_create(pthread_t* thread, void* (*run)(void*), void* arg);
+
+/* Run t, with the pool lock held on entry and on return */
+void lisppool_run(lisppool* p, lisptask* t) {
+  pthread_mutex_unlock(&p->lock);
+  *t->slot = lispval_eval_fork(*t->slot, t->depth, t->level);
+  pthread_mutex_lock(&p->lock);
+  t->done = 1;
+  pthread_cond_broadcast(&p->wake);
+}
+
+void lisppool_push(lisppool* p, lisptask* t) {
+  pthread_mutex_lock(&p->lock);
+  lispdeque_push(&p->deques[lisppool_self], t);
+  pthread_cond_signal(&p->wake);
+  pthread_mutex_unlock(&p->lock);
+}
+
+/* Wait for t to be done, running whatever tasks there are meanwhile */
+void lisppool_join(lisppool* p, lisptask* t) {
+  pthread_mutex_lock(&p->lock);
+  while (!t->done) {
+    lisptask* u = lisppool_take(p);
+    if (u) { lisppool_run(p, u); }
+    else { pthread_cond_wait(&p->wake, &p->lock); }
+  }
+  pthread_mutex_unlock(&p->lock);
+}
 
-  /* Evaluate Children */
+void* lisppool_main(void* arg) {
+  lisppool* p = lispval_pool;
+  lisppool_self = (int)(intptr_t)arg;
+  lispval_arena = p->arenas[lisppool_self];
+
+  pthread_mutex_lock(&p->lock);
+  while (!p->quit) {
+    lisptask* t = lisppool_take(p);
+    if (t) { lisppool_run(p, t); }
+    else { pthread_cond_wait(&p->wake, &p->lock); }
+  }
+  pthread_mutex_unlock(&p->lock);
+  return NULL;
+}
+
+/* Start n - 1 threads to evaluate alongside this one */
+void lisppool_start(int n) {
+  lisppool* p = malloc(sizeof(lisppool));
+  p->count = n;
+  p->deques = calloc(n, sizeof(lispdeque));
+  p->arenas = malloc(sizeof(lisparena*) * n);
+  p->threads = malloc(sizeof(pthread_t) * n);
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->wake, NULL);
+  p->quit = 0;
+  lispval_pool = p;
+
+  p->arenas[0] = lispval_arena;
+  for (int i = 1; i < n; i++) {
+    p->arenas[i] = lispval_arena ? lisparena_new() : NULL;
+    lispthread_create(&p->threads[i], lisppool_main, (void*)(intptr_t)i);
+  }
+}
+
+void lisppool_stop(void) {
+  lisppool* p = lispval_pool;
+  if (p == NULL) { return; }
+  pthread_mutex_lock(&p->lock);
+  p->quit = 1;
+  pthread_cond_broadcast(&p->wake);
+  pthread_mutex_unlock(&p->lock);
+
+  for (int i = 1; i < p->count; i++) {
+    pthread_join(p->threads[i], NULL);
+    if (p->arenas[i]) { lisparena_del(p->arenas[i]); }
+  }
+  for (int i = 0; i < p->count; i++) { free(p->deques[i].tasks); }
+  pthread_mutex_destroy(&p->lock);
+  pthread_cond_destroy(&p->wake);
+  free(p->deques);
+  free(p->arenas);
+  free(p->threads);
+  free(p);
+  lispval_pool = NULL;
+}
+
+/* Evaluate v, nested depth deep, handing its big children to the pool */
+lispval* lispval_eval_fork(lispval* v, int depth, int level) {
+  if (lispval_type(v) != LISPVAL_SEXPR || level >= LISPVAL_FORK_LEVELS
+  ||  depth + 1 >= lispval_max_depth) {
+    return lispval_eval_from(v, depth);
+  }
+
+  /* Find the children big enough to be tasks */
+  int count = 0;
+  lisptask* tasks = malloc(sizeof(lisptask) * (v->count + 1));
   for (int i = 0; i < v->count; i++) {
-    v->cell[i] = lispval_eval(v->cell[i]);
+    if (lispval_type(v->cell[i]) == LISPVAL_SEXPR
+    &&  lispval_size(v->cell[i], lispval_fork_size) >= lispval_fork_size) {
+      tasks[count++] = (lisptask){ &v->cell[i], depth + 1, level + 1, 0 };
+    }
   }
+  tasks[count].slot = NULL;
 
-  /* Error Checking */
+  /* Offer all but the first to other threads, which this one keeps */
+  for (int k = 1; k < count; k++) { lisppool_push(lispval_pool, &tasks[k]); }
+
+  /* Meanwhile evaluate the rest here */
+  lisptask* next = tasks;
   for (int i = 0; i < v->count; i++) {
-    if (v->cell[i]->type == LISPVAL_ERR) { return lispval_take(v, i); }
+    if (&v->cell[i] == next->slot) { next++; continue; }
+    v->cell[i] = lispval_eval_from(v->cell[i], depth + 1);
+  }
+  if (count > 0) {
+    *tasks[0].slot = lispval_eval_fork(*tasks[0].slot, depth + 1, level + 1);
   }
+  for (int k = 1; k < count; k++) { lisppool_join(lispval_pool, &tasks[k]); }
+  free(tasks);
 
-  /* Empty Expression */
-  if (v->count == 0) { return v; }
+  return lispval_eval_sexpr(v);
+}
+
+lispval* lispval_eval(lispval* v) {
+  if (lispval_pool == NULL || lispval_type(v) != LISPVAL_SEXPR
+  ||  lispval_size(v, lispval_fork_size) < lispval_fork_size) {
+    return lispval_eval_from(v, 0);
+  }
+
+  lispval* x = lispval_eval_fork(v, 0, 0);
+
+  /*
+  ** Parts of the value may sit in the arenas of other
+  ** threads, so copy it out into this one and release
+  ** theirs. Every task is done, so nothing uses them.
+  */
+  if (lispval_arena) {
+    x = lispval_copy(x);
+    for (int i = 1; i < lispval_pool->count; i++) {
+      lisparena_reset(lispval_pool->arenas[i]);
+    }
+  }
+  return x;
+}
+
+#else
+
+void lisppool_start(int n) { (void)n; }
+void lisppool_stop(void) {}
+
+lispval* lispval_eval(lispval* v) {
+  return lispval_eval_from(v, 0);
+}
+
+#endif
+
+/*
+** Compiled Lispy code is a flat array of words run
+** on a value stack. Every leaf becomes a PUSH of a
+** constant and every non-empty S-expression becomes
+** an APPLY of the values its children left on the
+** stack. Constants live in an arena owned by the
+** code so it can be kept and run many times.
+*/
+
+enum { LISPCODE_PUSH, LISPCODE_APPLY };
+
+typedef struct lispcode {
+  int count;
+  int slots;
+  intptr_t* code;
+  int depth;
+  lisparena* consts;
+} lispcode;
+
+void lispcode_emit(lispcode* c, intptr_t op, intptr_t arg) {
+  if (c->count + 2 > c->slots) {
+    c->slots = c->slots ? c->slots * 2 : 16;
+    c->code = realloc(c->code, sizeof(intptr_t) * c->slots);
+  }
+  c->code[c->count++] = op;
+  c->code[c->count++] = arg;
+}
+
+/*
+** Compile v, returning how many stack slots running
+** it takes. Child i runs with i values already below
+** it. Like the evaluator this keeps its own stack of
+** the S-expressions waiting on a child, each with the
+** index of that child and the most slots any of the
+** children before it took.
+*/
+int lispcode_compile_expr(lispcode* c, lispval* v) {
+  lispstack frames;
+  lispstack_init(&frames);
+  int i = 0;
+  int depth = 0;
+
+  while (1) {
+    int d;
+
+    /* Nesting deeper than the evaluator allows becomes the same error */
+    if (lispval_type(v) == LISPVAL_SEXPR && frames.count / 3 + 1 > lispval_max_depth) {
+      lispcode_emit(c, LISPCODE_PUSH, (intptr_t)lispval_err("Expression nested too deeply!"));
+      d = 1;
+    }
+    /* Leaves and empty expressions evaluate to themselves */
+    else if (lispval_type(v) != LISPVAL_SEXPR || v->count == 0) {
+      lispcode_emit(c, LISPCODE_PUSH, (intptr_t)lispval_copy(v));
+      d = 1;
+    }
+    /* Descend into the next child */
+    else if (i < v->count) {
+      lispstack_push(&frames, v);
+      lispstack_push(&frames, (void*)(intptr_t)i);
+      lispstack_push(&frames, (void*)(intptr_t)depth);
+      v = v->cell[i];
+      i = 0;
+      depth = 0;
+      continue;
+    }
+    /* Every child is compiled, so apply their values */
+    else {
+      lispcode_emit(c, LISPCODE_APPLY, v->count);
+      d = depth;
+    }
+
+    if (frames.count == 0) {
+      lispstack_free(&frames);
+      return d;
+    }
+    depth = (intptr_t)lispstack_pop(&frames);
+    i = (intptr_t)lispstack_pop(&frames);
+    v = lispstack_pop(&frames);
+    if (i + d > depth) { depth = i + d; }
+    i++;
+  }
+}
+
+lispcode* lispcode_compile(lispval* v) {
+  lispcode* c = malloc(sizeof(lispcode));
+  c->count = 0;
+  c->slots = 0;
+  c->code = NULL;
+  c->consts = lisparena_new();
+
+  /* Copy constants into the code's own arena */
+  lisparena* arena = lispval_arena;
+  lispval_arena = c->consts;
+  c->depth = lispcode_compile_expr(c, v);
+  lispval_arena = arena;
+
+  return c;
+}
+
+void lispcode_del(lispcode* c) {
+  lisparena_del(c->consts);
+  free(c->code);
+  free(c);
+}
+
+/* Apply an S-expression to the n values it evaluated to */
+lispval* lispcode_apply(lispval** xs, int n) {
+
+  /* Error Checking */
+  for (int i = 0; i < n; i++) {
+    if (lispval_type(xs[i]) == LISPVAL_ERR) { return xs[i]; }
+  }
 
   /* Single Expression */
-  if (v->count == 1) { return lispval_take(v, 0); }
+  if (n == 1) { return xs[0]; }
 
   /* Ensure First Element is Symbol */
-  lispval* f = lispval_pop(v, 0);
-  if (f->type != LISPVAL_SYM) {
-    lispval_del(f); lispval_del(v);
+  if (lispval_type(xs[0]) != LISPVAL_SYM) {
     return lispval_err("S-expression Does not start with symbol!");
   }
 
-  /* Call builtin with operator */
-  lispval* result = builtin_op(v, f->sym);
-  lispval_del(f);
-  return result;
+  return builtin_op(xs + 1, n - 1, xs[0]->sym);
 }
 
-lispval* lispval_eval(lispval* v) {
-  /* Evaluate Sexpressions */
-  if (v->type == LISPVAL_SEXPR) { return lispval_eval_sexpr(v); }
-  /* All other lval types remain the same */
-  return v;
+lispval* lispcode_run(lispcode* c) {
+
+  /* Values pushed from the constants are borrowed, never freed */
+  lispval** stack = malloc(sizeof(lispval*) * c->depth);
+  char* owned = malloc(c->depth);
+  int top = 0;
+
+  for (int pc = 0; pc < c->count; pc += 2) {
+    intptr_t arg = c->code[pc+1];
+    switch (c->code[pc]) {
+
+      case LISPCODE_PUSH:
+        stack[top] = (lispval*)arg;
+        owned[top] = 0;
+        top++;
+      break;
+
+      case LISPCODE_APPLY: {
+        top -= arg;
+        lispval* r = lispcode_apply(&stack[top], arg);
+
+        /* Keep ownership of a passed through argument, drop the rest */
+        char o = 1;
+        for (int i = 0; i < arg; i++) {
+          if (stack[top+i] == r) { o = owned[top+i]; }
+          else if (owned[top+i]) { lispval_del(stack[top+i]); }
+        }
+
+        stack[top] = r;
+        owned[top] = o;
+        top++;
+      } break;
+    }
+  }
+
+  lispval* x = owned[0] ? stack[0] : lispval_copy(stack[0]);
+  free(stack);
+  free(owned);
+  return x;
+}
+
+/* Count the heap bytes held by a lispval tree */
+size_t lispval_footprint(lispval* v) {
+  lispstack pending;
+  lispstack_init(&pending);
+  size_t total = 0;
+
+  while (1) {
+    if (!lispval_is_fixnum(v)) {
+      total += sizeof(lispval);
+      switch (v->type) {
+        case LISPVAL_ERR: total += strlen(v->err) + 1; break;
+        case LISPVAL_SYM: break;
+        case LISPVAL_SEXPR:
+          total += sizeof(lispval*) * v->slots;
+          for (int i = 0; i < v->count; i++) {
+            lispstack_push(&pending, v->cell[i]);
+          }
+        break;
+      }
+    }
+    if (pending.count == 0) { break; }
+    v = lispstack_pop(&pending);
+  }
+
+  lispstack_free(&pending);
+  return total;
+}
+
+/* With --footprint each expression read is preceded by its footprint */
+int use_footprint = 0;
+
+void lispval_footprint_println(lispval* v) {
+  lispout_write(&lispout_stdout, "Footprint: ", 11);
+  lispout_long(&lispout_stdout, (long)lispval_footprint(v));
+  lispout_write(&lispout_stdout, " bytes\n", 7);
+}
+
+/* Compiled code for recently seen inputs, used with --vm */
+enum { LISPCODE_CACHE = 256 };
+
+typedef struct {
+  char* input;
+  lispcode* code;
+} lispcode_entry;
+
+int use_vm = 0;
+int use_mpc = 0;
+lispcode_entry lispcode_cache[LISPCODE_CACHE];
+
+lispcode_entry* lispcode_cache_find(char* input) {
+  unsigned long h = lispsym_hash(input, strlen(input));
+  return &lispcode_cache[h % LISPCODE_CACHE];
+}
+
+void lispcode_cache_put(lispcode_entry* e, char* input, lispcode* code) {
+  if (e->code) {
+    free(e->input);
+    lispcode_del(e->code);
+  }
+  e->input = malloc(strlen(input) + 1);
+  strcpy(e->input, input);
+  e->code = code;
 }
 
 /*
-static int numberOfNodes(mpc_ast_t* tree) {
-  if (tree->children_num == 0) {
-    return 1; 
+** The mpc grammar recurses in C for each level of
+** nesting, so input nested deeper than it can take
+** runs as a compiled program, which keeps its own
+** stack. The recursive engine stays in use for
+** everything else as it is the faster of the two.
+*/
+enum { LISPVAL_MPC_RECURSE = 1000 };
+
+#ifdef LISPVAL_THREADS
+
+/*
+** The default stack of a thread other than the first
+** is as small as 512KB on some systems, too small for
+** the recursive engine at its deepest, so threads are
+** started with room for every level it may go to.
+*/
+enum { LISPVAL_THREAD_STACK = LISPVAL_MPC_RECURSE * 4096 };
+
+int lispthread_create(pthread_t* thread, void* (*run)(void*), void* arg) {
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, LISPVAL_THREAD_STACK);
+  int err = pthread_create(thread, &attr, run, arg);
+  pthread_attr_destroy(&attr);
+  return err;
+}
+
+#endif
+
+/* Deepest parenthesis nesting in s, the only nesting the grammar has */
+int lispval_nesting(const char* s, size_t len) {
+  int depth = 0, deepest = 0;
+  for (size_t i = 0; i < len; i++) {
+    if (s[i] == '(') { if (++depth > deepest) { deepest = depth; } }
+    else if (s[i] == ')') { depth--; }
   }
-  if (tree->children_num >= 1) {
-    int total = 1;
-    for(int i = 0; i < tree->children_num; i++) {
-      total += numberOfNodes(tree->children[i]);
+  return deepest;
+}
+
+int lispval_parse_mpc(const char* name, const char* input, size_t len,
+  mpc_parser_t* parser, mpc_program_t* program, mpc_result_t* r) {
+  if (lispval_nesting(input, len) < LISPVAL_MPC_RECURSE) {
+    return mpc_parse_view(name, input, len, parser, r);
+  }
+  return mpc_parse_program(name, input, len, program, r);
+}
+
+/*
+** With --jobs N a script read through the mpc grammar
+** is parsed on N threads. A quick scan balancing the
+** parentheses cuts it between top-level forms into a
+** few chunks per thread, and each thread takes the
+** next chunk from a shared counter as it finishes the
+** last, so one slow chunk holds nobody up. The forms
+** of every chunk are then joined up again in order.
+** Each thread reads into an arena of its own, kept
+** until the forms have been evaluated. The grammar is
+** frozen, and the only symbols it reads are builtins
+** interned at startup, so threads only ever read the
+** symbol table. Input too small to be worth it, or
+** with unbalanced parentheses, is parsed in one piece.
+*/
+int lispval_jobs = 1;
+
+#ifdef LISPVAL_THREADS
+
+enum { LISPCHUNK_MIN = 16 * 1024, LISPCHUNK_PER_JOB = 8 };
+
+typedef struct {
+  const char* start;
+  size_t len;
+  /* Where start is in the whole script, for errors */
+  mpc_state_t origin;
+  int ok;
+  mpc_result_t r;
+} lispchunk;
+
+typedef struct {
+  const char* name;
+  mpc_parser_t* parser;
+  mpc_program_t* program;
+  lispchunk* chunks;
+  int count;
+  int next;
+  pthread_mutex_t lock;
+} lispjobs;
+
+typedef struct {
+  lispjobs* jobs;
+  lisparena* arena;
+  pthread_t thread;
+} lispworker;
+
+/* Cut s into chunks of whole top-level forms, returning how many, or 0 if unbalanced */
+int lispchunk_split(const char* s, size_t len, size_t target, lispchunk** chunks) {
+  int count = 0, slots = 16;
+  long depth = 0, row = 0;
+  size_t start = 0, line = 0;
+  mpc_state_t origin = { 0, 0, 0 };
+  *chunks = malloc(sizeof(lispchunk) * slots);
+
+  for (size_t i = 0; i < len; i++) {
+    if (s[i] == '(') { depth++; }
+    else if (s[i] == ')' && --depth < 0) { break; }
+    else if (s[i] == '\n') { row++; line = i + 1; }
+
+    /* Whitespace outside any form always lies between two of them */
+    if (depth == 0 && i + 1 - start >= target && i + 1 < len
+    &&  lispchars[(unsigned char)s[i]] == LISPCHAR_SPACE) {
+      if (count == slots) {
+        slots *= 2;
+        *chunks = realloc(*chunks, sizeof(lispchunk) * slots);
+      }
+      (*chunks)[count++] = (lispchunk){ s + start, i + 1 - start, origin, 0, { 0 } };
+      start = i + 1;
+      origin = (mpc_state_t){ (long)start, row, (long)(start - line) };
     }
-    return total;
   }
-  return 0;
+
+  if (depth != 0) { free(*chunks); *chunks = NULL; return 0; }
+  if (count == slots) { *chunks = realloc(*chunks, sizeof(lispchunk) * (slots + 1)); }
+  (*chunks)[count++] = (lispchunk){ s + start, len - start, origin, 0, { 0 } };
+  return count;
 }
+
+void lispjobs_run(lispjobs* j) {
+  for (;;) {
+    pthread_mutex_lock(&j->lock);
+    int k = j->next++;
+    pthread_mutex_unlock(&j->lock);
+    if (k >= j->count) { return; }
+    lispchunk* c = &j->chunks[k];
+    c->ok = lispval_parse_mpc(j->name, c->start, c->len, j->parser, j->program, &c->r);
+  }
+}
+
+void* lispworker_main(void* arg) {
+  lispworker* w = arg;
+  lispval_arena = w->arena;
+  lispjobs_run(w->jobs);
+  return NULL;
+}
+
+/*
+** Parse a script as lispval_parse_mpc does, on up to
+** lispval_jobs threads. The forms may be left in the
+** arenas of the threads, which go in arenas, one per
+** extra thread, NULL when not reading into arenas, to
+** be deleted by the caller once it is done with them.
 */
+int lispval_parse_jobs(const char* name, const char* input, size_t len,
+  mpc_parser_t* parser, mpc_program_t* program, mpc_result_t* r, lisparena** arenas) {
 
-void evalAndPrint(char* input, mpc_parser_t* parser) {
-  /* Attempt to Parse the user Input */
+  int workers = lispval_jobs - 1;
+  for (int i = 0; i < workers; i++) { arenas[i] = NULL; }
+
+  size_t target = len / ((size_t)lispval_jobs * LISPCHUNK_PER_JOB);
+  if (target < LISPCHUNK_MIN) { target = LISPCHUNK_MIN; }
+
+  lispjobs j = { name, parser, program, NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER };
+  j.count = workers > 0 ? lispchunk_split(input, len, target, &j.chunks) : 0;
+  if (j.count < 2) {
+    free(j.chunks);
+    return lispval_parse_mpc(name, input, len, parser, program, r);
+  }
+
+  /* This thread takes chunks too, into its own arena */
+  if (workers > j.count - 1) { workers = j.count - 1; }
+  lispworker* ws = malloc(sizeof(lispworker) * workers);
+  for (int i = 0; i < workers; i++) {
+    ws[i].jobs = &j;
+    ws[i].arena = arenas[i] = lispval_arena ? lisparena_new() : NULL;
+    lispthread_create(&ws[i].thread, lispworker_main, &ws[i]);
+  }
+  lispjobs_run(&j);
+  for (int i = 0; i < workers; i++) { pthread_join(ws[i].thread, NULL); }
+  free(ws);
+  pthread_mutex_destroy(&j.lock);
+
+  /* The first chunk to fail has the error the whole script would have */
+  int failed = -1;
+  int forms = 0;
+  for (int k = 0; k < j.count; k++) {
+    if (!j.chunks[k].ok) { failed = k; break; }
+    forms += ((lispval*)j.chunks[k].r.output)->count;
+  }
+
+  lispval* v = failed < 0 ? lispval_sexpr_sized(forms) : NULL;
+  for (int k = 0; k < j.count; k++) {
+    lispchunk* c = &j.chunks[k];
+    if (k == failed) {
+      mpc_state_t* s = &c->r.error->state;
+      if (s->row == 0) { s->col += c->origin.col; }
+      s->row += c->origin.row;
+      s->pos += c->origin.pos;
+      r->error = c->r.error;
+    } else if (!c->ok) {
+      mpc_err_delete(c->r.error);
+    } else if (v) {
+      lispval* x = c->r.output;
+      for (int i = 0; i < x->count; i++) { lispval_add(v, x->cell[i]); }
+      x->count = 0;
+      lispval_del(x);
+    } else {
+      lispval_del(c->r.output);
+    }
+  }
+  free(j.chunks);
+
+  if (v) { r->output = v; }
+  return v != NULL;
+}
+
+#else
+
+int lispval_parse_jobs(const char* name, const char* input, size_t len,
+  mpc_parser_t* parser, mpc_program_t* program, mpc_result_t* r, lisparena** arenas) {
+  (void)arenas;
+  return lispval_parse_mpc(name, input, len, parser, program, r);
+}
+
+#endif
+
+/* Read one line of input, printing the error and giving NULL if it does not parse */
+lispval* evalRead(char* input, mpc_parser_t* parser, mpc_program_t* program) {
+  size_t len = strlen(input);
+  lispval* x = use_mpc ? NULL : lispval_read_string(input, len);
   mpc_result_t r;
-  if (mpc_parse("<stdin>", input, parser, &r)) {
-    lispval* x = lispval_eval(lispval_read(r.output));
-    lispval_println(x);
+  if (x || lispval_parse_mpc("<stdin>", input, len, parser, program, &r)) {
+    return x ? x : r.output;
+  }
+
+  /* Otherwise Print the Error */
+  mpc_err_print(r.error);
+  mpc_err_delete(r.error);
+  /* Drop anything read before the error */
+  if (lispval_arena) { lisparena_reset(lispval_arena); }
+  return NULL;
+}
+
+void evalAndPrint(char* input, mpc_parser_t* parser, mpc_program_t* program) {
+
+  /* The footprint is of what was read, so read even inputs compiled already */
+  lispval* x = NULL;
+  if (use_footprint) {
+    x = evalRead(input, parser, program);
+    if (!x) { return; }
+    lispval_footprint_println(x);
+  }
+
+  /* Rerun previously compiled inputs without parsing them again */
+  lispcode_entry* e = NULL;
+  if (use_vm) {
+    e = lispcode_cache_find(input);
+    if (e->code && strcmp(e->input, input) == 0) {
+      if (x) { lispval_del(x); }
+      x = lispcode_run(e->code);
+      lispval_println(x);
+      lispout_flush(&lispout_stdout);
+      if (lispval_arena) { lisparena_reset(lispval_arena); }
+      else { lispval_del(x); }
+      return;
+    }
+  }
+
+  /* Attempt to Parse the user Input */
+  if (!x) { x = evalRead(input, parser, program); }
+  if (!x) { return; }
+
+  if (use_vm) {
+    lispcode* code = lispcode_compile(x);
     lispval_del(x);
-    //mpc_ast_print(r.output);    //print AST
-    //printf("Number of nodes: %d\n", numberOfNodes(r.output)); // print NUmber of nodes
-    mpc_ast_delete(r.output);
+    lispcode_cache_put(e, input, code);
+    x = lispcode_run(code);
   } else {
-    /* Otherwise Print the Error */
-    mpc_err_print(r.error);
-    mpc_err_delete(r.error);
+    x = lispval_eval(x);
   }
+  lispval_println(x);
+  lispout_flush(&lispout_stdout);
+  /* Release the whole tree at once when evaluating in an arena */
+  if (lispval_arena) { lisparena_reset(lispval_arena); }
+  else { lispval_del(x); }
 }
 
+/* Evaluate one top-level form of a script, print it and release it */
+void evalForm(lispval* x) {
+  if (use_footprint) { lispval_footprint_println(x); }
+  if (use_vm) {
+    lispcode* code = lispcode_compile(x);
+    lispval_del(x);
+    x = lispcode_run(code);
+    lispcode_del(code);
+  } else {
+    x = lispval_eval(x);
+  }
+  lispval_println(x);
+  if (lispval_arena) { lisparena_reset(lispval_arena); }
+  else { lispval_del(x); }
+}
+
+/* Read the whole of f into a NUL terminated buffer */
+char* readAll(FILE* f, size_t* len) {
+  size_t slots = 64 * 1024;
+  char* buf = malloc(slots);
+  *len = 0;
+  size_t n;
+  while ((n = fread(buf + *len, 1, slots - *len - 1, f)) > 0) {
+    *len += n;
+    if (slots - *len - 1 == 0) {
+      slots *= 2;
+      buf = realloc(buf, slots);
+    }
+  }
+  buf[*len] = '\0';
+  return buf;
+}
+
+/*
+** Streams are pushed through an mpc feed a line at
+** a time, so each form is evaluated as soon as the
+** line closing it has arrived.
+*/
+int feedScript(FILE* f, const char* name, mpc_parser_t* item, long* forms, size_t* len) {
+  mpc_feed_t* feed = mpc_feed_new(name, item, (mpc_dtor_t)lispval_del);
+  /* Forms are only whole once their parentheses balance */
+  mpc_feed_nesting(feed, '(', ')');
+  /* Forms too deep for the recursive parser run compiled */
+  mpc_program_t* deep = mpc_compile(item);
+  mpc_feed_program(feed, deep, LISPVAL_MPC_RECURSE);
+  static char chunk[64 * 1024];
+  int status = 0;
+  int done = 0;
+  mpc_result_t r;
+
+  while (!done) {
+    /* Stop at newlines rather than wait for a full chunk */
+    size_t n = 0;
+    int c;
+    while (n < sizeof(chunk) && (c = getc(f)) != EOF) {
+      chunk[n++] = c;
+      if (c == '\n') { break; }
+    }
+    if (n > 0) { mpc_parser_feed(feed, chunk, n); *len += n; }
+    else { mpc_feed_end(feed); }
+
+    int res;
+    while ((res = mpc_feed_next(feed, &r)) == MPC_FEED_OUTPUT) {
+      evalForm(r.output);
+      (*forms)++;
+    }
+    if (res == MPC_FEED_ERROR) {
+      lispout_flush(&lispout_stdout);
+      mpc_err_print_to(r.error, stderr);
+      mpc_err_delete(r.error);
+      status = 1;
+    }
+    /* Show results before blocking on the next read */
+    if (res == MPC_FEED_MORE) { lispout_flush(&lispout_stdout); }
+    else { done = 1; }
+    /* Outputs thrown away while waiting for more input */
+    if (lispval_arena) { lisparena_reset(lispval_arena); }
+  }
+
+  mpc_feed_delete(feed);
+  mpc_program_delete(deep);
+  return status;
+}
+
+/* Seconds on the wall clock where there is one, since work may be spread over several threads */
+double lispclock(void) {
+#ifdef LISPVAL_THREADS
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+#else
+  return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+/*
+** Script mode evaluates every top-level form of a
+** file, or of stdin when the name is "-", in order
+** and without prompting. Output is fully buffered
+** and throughput is reported on stderr at the end.
+** Returns the exit status.
+*/
+int runScript(const char* filename, mpc_parser_t* parser, mpc_program_t* program, mpc_parser_t* item) {
+  FILE* f = strcmp(filename, "-") == 0 ? stdin : fopen(filename, "rb");
+  if (f == NULL) { perror(filename); return 1; }
+  const char* name = f == stdin ? "<stdin>" : filename;
+
+  double start = lispclock();
+  long forms = 0;
+  size_t len = 0;
+  int status = 0;
+  mpc_result_t r;
+
+  if (use_mpc && f == stdin) {
+    status = feedScript(f, name, item, &forms, &len);
+  } else if (use_mpc) {
+    /* Validation mode reads files through the mpc grammar first, mapped where they can be */
+    const char* mapped = mpc_contents_map(filename, &len);
+    char* buf = mapped ? NULL : readAll(f, &len);
+    fclose(f);
+    lisparena** arenas = malloc(sizeof(lisparena*) * lispval_jobs);
+
+    /* Read into an arena of its own, kept while evaluation resets the usual one after each form */
+    lisparena* arena = lispval_arena;
+    lisparena* read = arena ? lisparena_new() : NULL;
+    lispval_arena = read;
+    int ok = lispval_parse_jobs(name, mapped ? mapped : buf, len, parser, program, &r, arenas);
+    lispval_arena = arena;
+
+    if (ok) {
+      lispval* v = r.output;
+      for (int i = 0; i < v->count; i++) {
+        evalForm(v->cell[i]);
+        forms++;
+      }
+      v->count = 0;
+      lispval_del(v);
+    } else {
+      mpc_err_print_to(r.error, stderr);
+      mpc_err_delete(r.error);
+      status = 1;
+    }
+    for (int i = 0; i < lispval_jobs - 1; i++) {
+      if (arenas[i]) { lisparena_del(arenas[i]); }
+    }
+    free(arenas);
+    if (read) { lisparena_del(read); }
+    if (mapped) { mpc_contents_unmap(mapped, len); }
+    free(buf);
+  } else {
+    char* buf = readAll(f, &len);
+    if (f != stdin) { fclose(f); }
+
+    /* Evaluate each form as soon as it has been read */
+    lisplexer l = { buf, buf + len };
+    lisptok t;
+    while ((t = lisplexer_next(&l)).type != LISPTOK_END) {
+      lispval* x = lispval_read_tok(&l, t, 0);
+      if (x == NULL) {
+        /* Let the mpc grammar report where the script went wrong */
+        if (lispval_arena) { lisparena_reset(lispval_arena); }
+        if (lispval_parse_mpc(name, buf, len, parser, program, &r)) {
+          /* The grammar takes what the reader did not, so say where the reader stopped */
+          lispval_del(r.output);
+          lispout_flush(&lispout_stdout);
+          lisplexer_error(name, buf, l.pos);
+        } else {
+          lispout_flush(&lispout_stdout);
+          mpc_err_print_to(r.error, stderr);
+          mpc_err_delete(r.error);
+        }
+        if (lispval_arena) { lisparena_reset(lispval_arena); }
+        status = 1;
+        break;
+      }
+      evalForm(x);
+      forms++;
+    }
+    free(buf);
+  }
+
+  lispout_flush(&lispout_stdout);
+  double secs = lispclock() - start;
+  if (secs <= 0) { secs = 1e-9; }
+  fprintf(stderr, "%ld expressions, %zu bytes in %.3f s (%.0f expressions/s, %.2f MB/s)\n",
+    forms, len, secs, forms / secs, len / secs / (1024.0 * 1024.0));
+  return status;
+}
 
 int main(int argc, char** argv) {
+  /* Evaluate in an arena unless asked to use malloc for every lispval */
+  int use_arena = 1;
+  /* Any other argument names a script to run instead of the REPL */
+  char* script = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--no-arena") == 0) { use_arena = 0; }
+    else if (strcmp(argv[i], "--vm") == 0) { use_vm = 1; }
+    else if (strcmp(argv[i], "--mpc") == 0) { use_mpc = 1; }
+    else if (strcmp(argv[i], "--footprint") == 0) { use_footprint = 1; }
+    else if (strcmp(argv[i], "--max-depth") == 0 && i + 1 < argc) {
+      lispval_max_depth = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+      lispval_jobs = atoi(argv[++i]);
+      if (lispval_jobs < 1) { lispval_jobs = 1; }
+    }
+    else if (strcmp(argv[i], "--fork-size") == 0 && i + 1 < argc) {
+      lispval_fork_size = atoi(argv[++i]);
+      if (lispval_fork_size < 1) { lispval_fork_size = 1; }
+    }
+    else { script = argv[i]; }
+  }
+#ifndef LISPVAL_THREADS
+  lispval_jobs = 1;
+#endif
+  if (use_arena) { lispval_arena = lisparena_new(); }
+  /* The pool takes the arena of this thread as its first */
+  if (lispval_jobs > 1) { lisppool_start(lispval_jobs); }
+
+  lispsym_builtins();
+  lispout_stdout = lispout_file(stdout);
+
   // Crete some parsers
   mpc_parser_t* Number = mpc_new("number");
   mpc_parser_t* Symbol = mpc_new("symbol");
@@ -325,17 +1949,48 @@ int main(int argc, char** argv) {
   mpc_parser_t* Expr = mpc_new("expr");
   mpc_parser_t* Lispy = mpc_new("lispy");
 
-  // Define language
-  mpca_lang(MPCA_LANG_DEFAULT,
-    "                                                                      \
-    number: /-?[0-9]+/ ;                                                   \
-    symbol: '+' | '-' | '*' | '/' | '%' | '^' | /min/ | /max/ ;            \
-    sexpr  : '(' <expr>* ')' ;                                             \
-    expr: <number> | <symbol> | <sexpr> ;                                  \
-    lispy: /^/ <expr>* /$/ ;                                               \
-    ",
-    Number, Symbol, Sexpr, Expr, Lispy);
-
+  // Define language, reading straight into lispvals
+  //   number : /-?[0-9]+/ ;
+  //   symbol : '+' | '-' | '*' | '/' | '%' | '^' | "min" | "max" ;
+  //   sexpr  : '(' <expr>* ')' ;
+  //   expr   : <number> | <symbol> | <sexpr> ;
+  //   lispy  : /^/ <expr>* /$/ ;
+  // Tokens skip the whitespace in front of them
+  mpc_define(Number, mpc_stripl(mpc_expect(
+    mpc_apply(mpc_re("-?[0-9]+"), lispval_read_num), "number")));
+
+  mpc_define(Symbol, mpc_stripl(mpc_expect(mpc_apply(mpc_or(8,
+    mpc_string("+"), mpc_string("-"), mpc_string("*"), mpc_string("/"),
+    mpc_string("%"), mpc_string("^"), mpc_string("min"), mpc_string("max")),
+    lispval_read_sym), "symbol")));
+
+  mpc_define(Sexpr, mpc_and(3, mpcf_snd_free,
+    mpc_stripl(mpc_char('(')),
+    mpc_many(lispval_read_list, Expr),
+    mpc_stripl(mpc_char(')')),
+    free, (mpc_dtor_t)lispval_del));
+
+  mpc_define(Expr, mpc_or(3, Number, Symbol, Sexpr));
+
+  mpc_define(Lispy, mpc_whole(
+    mpc_stripr(mpc_many(lispval_read_list, Expr)),
+    (mpc_dtor_t)lispval_del));
+
+
+  /* The grammar is finished, so fix it in place before anything parses with it */
+  mpc_freeze(Lispy);
+
+  /* The grammar compiled for input nested too deep to parse recursively */
+  mpc_program_t* Program = mpc_compile(Lispy);
+
+  if (script) {
+    int status = runScript(script, Lispy, Program, Expr);
+    mpc_program_delete(Program);
+    mpc_cleanup(5, Number, Symbol, Sexpr, Expr, Lispy);
+    lisppool_stop();
+    if (lispval_arena) { lisparena_del(lispval_arena); }
+    return status;
+  }
 
   puts("Lispy Version 0.0.0.0.1");
   puts("Press Ctrl+c to Exit\n");
@@ -343,11 +1998,14 @@ int main(int argc, char** argv) {
   while(1) {
     char* input = readline("lispy> ");
     add_history(input);
-    evalAndPrint(input, Lispy);
+    evalAndPrint(input, Lispy, Program);
     free(input);
   }
 
   /* Undefine and Delete our Parsers */
+  mpc_program_delete(Program);
   mpc_cleanup(5, Number, Symbol, Sexpr, Expr, Lispy);
+  lisppool_stop();
+  if (lispval_arena) { lisparena_del(lispval_arena); }
   return 0;
 }
\ No newline at end of file